@@ -5,22 +5,48 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <ctime>
+#include <deque>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits>
 #include <list>
+#include <map>
+#include <mutex>
 #include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "rapidjson/reader.h"
 #include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
 #include "rapidjson/filereadstream.h"
 #include "rapidjson/filewritestream.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #define printd(...) fprintf(stderr, __VA_ARGS__)
 //#define printd(...)
 
@@ -31,6 +57,11 @@ using namespace rapidjson;
 enum {
     FLAG_SPLIT_MBOX    =  1 << 1,
     FLAG_DUMP_IDS      =  1 << 2,
+    FLAG_STATS         =  1 << 3,
+    FLAG_OFFSET_INDEX  =  1 << 4,
+    FLAG_MSF           =  1 << 5,
+    FLAG_PREALLOCATE   =  1 << 6,
+    FLAG_DIRECT_IO     =  1 << 7,
 };
 
 int flags;
@@ -39,20 +70,215 @@ char *idfile = NULL;
 // --since and --until options
 time_t since = 0;
 time_t until = numeric_limits<time_t>::max();
+// --jobs option: number of formatter threads, 1 means no pipeline at all
+unsigned jobs = 1;
+// --split option, also sets FLAG_SPLIT_MBOX
+enum class Split {
+    none,
+    year,
+    month,
+    week,
+    thread,
+} split = Split::none;
+// max size of an output file with --split=size:N, 0 for no limit
+unsigned long long split_size = 0;
+// --max-open option: max number of open files with --split=thread
+unsigned max_open = 256;
+// --writers option: max number of output files with their own writer thread
+// in --split mode, 0 to write from the conversion thread. With
+// --format=maildir, the number of threads creating message files.
+unsigned max_writers = 0;
+// --format option
+enum class Format {
+    mbox,
+    maildir,
+    none, // only the sinks
+} format = Format::mbox;
+// --body-encoding option
+enum class BodyEncoding {
+    none,
+    qp,
+    base64,
+} body_encoding = BodyEncoding::none;
+// --mbox-variant option
+enum class MboxVariant {
+    mboxo,   // no escaping, as hn2mbox always did
+    mboxrd,
+    mboxcl2,
+} mbox_variant = MboxVariant::mboxo;
+// --compress=zstd[:LEVEL] option, 0 for no compression
+int zstd_level = 0;
+// --frame-messages option: max number of messages in a zstd frame
+unsigned frame_messages = 1000;
+// --sort option
+enum class Sort {
+    none,
+    thread,
+    date,
+} sort_order = Sort::none;
+// --sort-memory option: memory for sorting before spilling to --tmpdir
+size_t sort_memory = 256 << 20;
+// --tmpdir option, $TMPDIR or /tmp by default
+const char *tmpdir = NULL;
+// --memory-limit option, 0 for no limit. shareMemory() splits it among the
+// parts of hn2mbox that grow with the input.
+size_t memory_limit = 0;
+// memory for the id map of --id-file before moving it to --tmpdir, 0 for no
+// limit
+size_t idmap_memory = 0;
+// memory for the --index terms collected by each formatting thread
+size_t index_memory = 64 << 20;
+// memory for the messages buffered by --split=thread
+size_t thread_buffer_memory = 64 << 20;
+// max number of open output files for --split by date or size, 0 for no
+// limit
+unsigned max_files = 0;
+// --extract and --message options
+char *extractfile = NULL;
+unsigned extract_message = 0;
+// --dedup option
+char *dedupfile = NULL;
+// --template option
+char *templatefile = NULL;
+// --where option
+char *whereexpr = NULL;
+// --match-any option
+char *keywordsfile = NULL;
+// --incremental option
+char *statefile = NULL;
+// --rebuild option
+char *fingerprintfile = NULL;
+// --ids and --jsonl options
+char *idsfile = NULL;
+char *jsonlfile = NULL;
+// --index and --search options
+char *indexdir = NULL;
+char *searchdir = NULL;
+
+// A bump allocator for the texts of the items. Memory is carved out of big
+// chunks and given back all at once, or back to a mark, keeping the chunks
+// for reuse, so once warmed up parsing doesn't call malloc at all. It follows
+// rapidjson's Allocator concept, so the reader's stack can live in one too.
+class Arena {
+public:
+    static const bool kNeedFree = false;
+    enum { chunk_size = 64 << 10 };
+
+    struct Mark {
+        size_t chunk;
+        size_t used;
+    };
+
+    Arena() : cur(0), used(0) {}
+    ~Arena()
+    {
+        for (auto &c : chunks)
+            free(c.data);
+    }
+
+    void *Malloc(size_t size)
+    {
+        size = (size + 7) & ~size_t(7);
+        if (chunks.empty() || used + size > chunks[cur].size)
+            nextChunk(size);
+        void *p = chunks[cur].data + used;
+        used += size;
+        return p;
+    }
+
+    void *Realloc(void *p, size_t old_size, size_t size)
+    {
+        if (!p)
+            return Malloc(size);
+        if (size <= old_size)
+            return p;
+        // the last block grows in place if it fits, p may also be in an
+        // older chunk
+        char *data = chunks[cur].data;
+        if ((char*)p >= data && (char*)p < data + used) {
+            size_t begin = (char*)p - data;
+            if (begin + ((old_size + 7) & ~size_t(7)) == used
+                    && begin + size <= chunks[cur].size) {
+                used = begin + ((size + 7) & ~size_t(7));
+                return p;
+            }
+        }
+        return memcpy(Malloc(size), p, old_size);
+    }
+
+    static void Free(void *) {}
+
+    // a NUL terminated copy of s
+    char *copy(const char *s, size_t len)
+    {
+        char *p = (char*)Malloc(len + 1);
+        memcpy(p, s, len);
+        p[len] = '\0';
+        return p;
+    }
+
+    Mark mark() const { return { cur, used }; }
+    void release(const Mark &m) { cur = m.chunk; used = m.used; }
+
+private:
+    void nextChunk(size_t size)
+    {
+        for (size_t i = chunks.empty() ? 0 : cur + 1; ; ++i) {
+            if (i == chunks.size()) {
+                size_t n = max<size_t>(size, chunk_size);
+                char *data = (char*)malloc(n);
+                if (!data) {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+                chunks.push_back({ data, n });
+            }
+            if (chunks[i].size >= size) {
+                cur = i;
+                used = 0;
+                return;
+            }
+        }
+    }
+
+    struct Chunk {
+        char *data;
+        size_t size;
+    };
+    vector<Chunk> chunks;
+    size_t cur; // chunk being carved
+    size_t used; // bytes of it
+};
+
+// A text field of an Item, NUL terminated, in the Arena of the parser or of
+// its Pipeline batch
+class Text {
+public:
+    Text() : p(""), n(0) {}
+    Text(const char *p, size_t n) : p(p), n(n) {}
+
+    const char *c_str() const { return p; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+
+private:
+    const char *p;
+    size_t n;
+};
 
 // Either a story or a comment
 struct Item {
-    string created_at;
-    string title;
-    string url;
-    string author;
+    Text created_at;
+    Text title;
+    Text url;
+    Text author;
     int points;
-    string story_text;
-    string comment_text;
+    Text story_text;
+    Text comment_text;
     unsigned num_comments;
     unsigned story_id;
-    string story_title;
-    string story_url;
+    Text story_title;
+    Text story_url;
     unsigned parent_id;
     unsigned created_at_i;
     unsigned objectID;
@@ -78,140 +304,4448 @@ enum class Element
     objectID,
 };
 
-typedef unordered_map <int, FILE*> Files;
-Files outputFiles;
-// get the file to output story or comment data based on the passed date
-FILE *getFile(struct tm *date)
+// An output file (or Maildir) of the --split option
+struct Partition {
+    string name; // "" for the unsplit output
+    unsigned long long size; // bytes written, for --split=size:N
+};
+
+// open (for appending) an output file
+FILE *openFile(const string &fname)
 {
-    if (!(flags & FLAG_SPLIT_MBOX))
-        return stdout;
+    printd("new file: %s\n", fname.c_str());
+    FILE *file = fopen(fname.c_str(), "a");
+    if (!file) {
+        fprintf(stderr, "could not open `%s' for writing: %s\n",
+                fname.c_str(), strerror(errno));
+        exit(1);
+    }
+    return file;
+}
 
-    int key = (date->tm_mon & 0xffff) | ((date->tm_year & 0xffff) << 16);
-//    printd("key 0x%x\n", key);
+// size of each file as hn2mbox left it, from the --preallocate manifest of
+// the previous run
+map<string, unsigned long long> manifest;
+const char manifestfile[] = "hn2mbox.manifest";
 
-    auto iter = outputFiles.find(key);
-    if (iter == outputFiles.end()) {
-        char fname[100];
-        if (!strftime(fname, sizeof fname, "HN-%Y-%m", date)) {
-            fprintf(stderr, "wrong date format!?\n");
+void readManifest()
+{
+    FILE *f = fopen(manifestfile, "r");
+    if (!f)
+        return;
+    unsigned long long size;
+    char name[PATH_MAX];
+    while (fscanf(f, "%llu %4095[^\n]", &size, name) == 2)
+        manifest[name] = size;
+    fclose(f);
+}
+
+void writeManifest()
+{
+    FILE *f = fopen(manifestfile, "w");
+    if (!f) {
+        fprintf(stderr, "could not open `%s' for writing: %s\n",
+                manifestfile, strerror(errno));
+        exit(1);
+    }
+    for (auto &m : manifest)
+        fprintf(f, "%llu %s\n", m.second, m.first.c_str());
+    if (fclose(f)) {
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// An output mbox file. It is just stdio unless --preallocate or --direct-io
+// are given: then it collects the data in an aligned buffer and writes it
+// out in big chunks that end at a block boundary, reserving disk space ahead
+// of them with fallocate() so the file doesn't get fragmented.
+class OutFile {
+public:
+    enum { align = 4096, chunk_size = 1 << 20 };
+
+    // open (for appending) the named file, or take stdout for ""
+    explicit OutFile(const string &name)
+        : name(name), file(NULL), fd(-1), buf(NULL), used(0), direct(false)
+    {
+        if (!(flags & (FLAG_PREALLOCATE | FLAG_DIRECT_IO))) {
+            file = name.empty() ? stdout : openFile(name);
+            return;
+        }
+        struct stat st;
+        if (name.empty()) {
+            // only a regular file can be preallocated
+            if (fstat(1, &st) || !S_ISREG(st.st_mode)) {
+                file = stdout;
+                return;
+            }
+            fd = 1;
+        } else {
+            printd("new file: %s\n", name.c_str());
+            fd = open(name.c_str(), O_WRONLY | O_CREAT, 0666);
+            if (fd < 0 || fstat(fd, &st)) {
+                fprintf(stderr, "could not open `%s' for writing: %s\n",
+                        name.c_str(), strerror(errno));
+                exit(1);
+            }
+        }
+        offset = st.st_size;
+        reserved = offset;
+        if (posix_memalign(&buf, align, chunk_size)) {
+            fprintf(stderr, "out of memory\n");
             exit(1);
         }
-        printd("new file: %s\n", fname);
-        FILE *file = fopen(fname, "a");
-        if (!file) {
-            fprintf(stderr, "could not open `%s' for writing: %s\n",
-                    fname, strerror(errno));
+        auto m = manifest.find(name);
+        if (m != manifest.end() && m->second > offset)
+            reserve(m->second - offset);
+    }
+
+    void write(const char *data, size_t len)
+    {
+        if (file) {
+            if (fwrite(data, 1, len, file) != len) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+            return;
+        }
+        while (len) {
+            // the first chunk after an unaligned start is shorter, so
+            // that all the following ones are aligned
+            size_t n = min(len, size_t(chunk_size - offset % align) - used);
+            memcpy((char*)buf + used, data, n);
+            used += n;
+            data += n;
+            len -= n;
+            if (used == chunk_size - offset % align)
+                flush();
+        }
+    }
+
+    void close()
+    {
+        if (file) {
+            if (file != stdout && fclose(file)) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+            return;
+        }
+        flush();
+        // give back the space reserved past the end
+        if (reserved > offset && ftruncate(fd, offset)) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (fd != 1 && ::close(fd)) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
             exit(1);
         }
-        auto res = outputFiles.insert(make_pair(key, file));
+        free(buf);
+        if (!name.empty())
+            manifest[name] = offset;
+    }
+
+private:
+    void reserve(unsigned long long len)
+    {
+        if ((flags & FLAG_PREALLOCATE)
+                && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            reserved = offset + len;
+        else
+            reserved = numeric_limits<unsigned long long>::max(); // give up
+    }
+
+    void flush()
+    {
+        if (!used)
+            return;
+        // without an estimate from the manifest grow the file in steps of
+        // a quarter of its size, between 8 and 256 chunks
+        if (offset + used > reserved)
+            reserve(min(max(offset / 4, 8ULL * chunk_size),
+                        256ULL * chunk_size));
+        // O_DIRECT needs aligned offsets and lengths, the tail of the file
+        // goes through the page cache
+        bool aligned = offset % align == 0 && used % align == 0;
+        if ((flags & FLAG_DIRECT_IO) && aligned != direct) {
+            int fl = fcntl(fd, F_GETFL);
+            if (fcntl(fd, F_SETFL, aligned ? fl | O_DIRECT : fl & ~O_DIRECT)) {
+                fprintf(stderr, "--direct-io not supported for `%s': %s\n",
+                        name.c_str(), strerror(errno));
+                exit(1);
+            }
+            direct = aligned;
+        }
+        for (size_t done = 0; done < used; ) {
+            ssize_t n = pwrite(fd, (char*)buf + done, used - done,
+                               offset + done);
+            if (n < 0 && errno != EINTR) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+            if (n > 0)
+                done += n;
+        }
+        offset += used;
+        used = 0;
+    }
+
+    string name;
+    FILE *file; // stdio output, NULL if writing by ourselves
+    int fd;
+    void *buf;
+    size_t used; // bytes in buf
+    unsigned long long offset; // file offset of buf
+    unsigned long long reserved; // end of the allocated space
+    bool direct; // O_DIRECT currently set on fd
+};
+
+typedef unordered_map <const Partition*, OutFile*> Files;
+Files outputFiles;
+// when each output file was last switched to, to close the least recently
+// used one when there are max_files of them
+unordered_map<const Partition*, unsigned long> fileUse;
+// get the file to output story or comment data for the passed partition
+OutFile *getFile(const Partition *part)
+{
+    // consecutive items usually go to the same file
+    static const Partition *last_part = NULL;
+    static OutFile *last_file = NULL;
+    static unsigned long clock = 0;
+    if (last_file && part == last_part)
+        return last_file;
+
+    auto iter = outputFiles.find(part);
+    if (iter == outputFiles.end()) {
+        if (max_files && outputFiles.size() >= max_files) {
+            // it is opened again for appending if needed
+            auto oldest = outputFiles.begin();
+            for (auto i = outputFiles.begin(); i != outputFiles.end(); ++i)
+                if (fileUse[i->first] < fileUse[oldest->first])
+                    oldest = i;
+            oldest->second->close();
+            delete oldest->second;
+            fileUse.erase(oldest->first);
+            outputFiles.erase(oldest);
+        }
+        auto res = outputFiles.insert(make_pair(part, new OutFile(part->name)));
         iter = res.first;
-        // TODO close past files, for example files two months older than
-        // this one
     }
 
+    fileUse[part] = ++clock;
+    last_part = part;
+    last_file = iter->second;
     return iter->second;
 }
 
-// https://stackoverflow.com/questions/5665231/most-efficient-way-to-escape-xml-html-in-c-string
-string htmlEncode(const string& data)
+// Append data to out escaping the characters special in HTML. Runs of bytes
+// that need no escaping are found 16 at a time with SSE2 and copied in bulk.
+// See https://stackoverflow.com/questions/5665231/most-efficient-way-to-escape-xml-html-in-c-string
+void appendHtmlEscaped(string &out, const char *data, size_t len)
 {
-    string buffer;
-    buffer.reserve(data.size() * 1.1);
-    for(size_t pos = 0; pos != data.size(); ++pos) {
-        switch(data[pos]) {
-        case '&':  buffer.append("&amp;");       break;
-        case '\"': buffer.append("&quot;");      break;
-        case '\'': buffer.append("&apos;");      break;
-        case '<':  buffer.append("&lt;");        break;
-        case '>':  buffer.append("&gt;");        break;
-        default:   buffer.append(&data[pos], 1); break;
+    const char *p = data, *end = data + len;
+    const char *run = p; // start of the bytes not copied yet
+    while (p < end) {
+#ifdef __SSE2__
+        if (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            __m128i special = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')),
+                                 _mm_or_si128(
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('>')))));
+            unsigned mask = _mm_movemask_epi8(special);
+            if (!mask) {
+                p += 16;
+                continue;
+            }
+            p += __builtin_ctz(mask);
         }
+#endif
+        const char *entity;
+        switch (*p) {
+        case '&':  entity = "&amp;";   break;
+        case '\"': entity = "&quot;";  break;
+        case '\'': entity = "&apos;";  break;
+        case '<':  entity = "&lt;";    break;
+        case '>':  entity = "&gt;";    break;
+        default:   ++p;                continue;
+        }
+        out.append(run, p - run);
+        out += entity;
+        run = ++p;
     }
-    return buffer;
+    out.append(run, end - run);
 }
 
-// output item in mbox format
-void dumpItemAsEmail(const Item &item,
-                     const unordered_map<unsigned, unsigned> &item_ids)
+// printf-like append to a string
+void appendf(string &out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void appendf(string &out, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n < sizeof buf) {
+        out.append(buf, n);
+        return;
+    }
+    size_t pos = out.size();
+    out.resize(pos + n + 1);
+    va_start(ap, fmt);
+    vsnprintf(&out[pos], n + 1, fmt, ap);
+    va_end(ap);
+    out.resize(pos + n);
+}
+
+bool inDateRange(const Item &item)
 {
-    char datestr[100];
     time_t dt = item.created_at_i;
-    if (dt < since || dt >= until) {
-//        printd("date out of range %zu %zu %zu\n", since, dt, until);
+    return dt >= since && dt < until;
+}
+
+// The objectIDs already converted, for --dedup: a bitset in a file mapped in
+// memory, so it carries over to the next runs.
+class SeenIds {
+public:
+    explicit SeenIds(const char *fname)
+        : fname(fname), bits(NULL), size(0), duplicates(0)
+    {
+        fd = open(fname, O_RDWR | O_CREAT, 0666);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st)) {
+            fprintf(stderr, "could not open `%s': %s\n", fname,
+                    strerror(errno));
+            exit(1);
+        }
+        if (st.st_size)
+            map(st.st_size);
+    }
+
+    ~SeenIds()
+    {
+        if (bits)
+            munmap(bits, size);
+        close(fd);
+    }
+
+    // mark id as seen, return whether it already was
+    bool testAndSet(unsigned id)
+    {
+        size_t byte = id / 8;
+        if (byte >= size)
+            grow(byte + 1);
+        unsigned char mask = 1 << id % 8;
+        if (bits[byte] & mask) {
+            ++duplicates;
+            return true;
+        }
+        bits[byte] |= mask;
+        return false;
+    }
+
+    void printStats()
+    {
+        fprintf(stderr, "duplicates skipped %lu\n", duplicates);
+    }
+
+private:
+    void grow(size_t min_size)
+    {
+        // HN ids are dense and keep growing, leave room for a few million
+        size_t new_size = (min_size + (1 << 20)) & ~(((size_t)1 << 20) - 1);
+        if (ftruncate(fd, new_size)) {
+            fprintf(stderr, "could not extend `%s': %s\n", fname,
+                    strerror(errno));
+            exit(1);
+        }
+        if (bits)
+            munmap(bits, size);
+        map(new_size);
+    }
+
+    void map(size_t new_size)
+    {
+        void *m = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+        if (m == MAP_FAILED) {
+            fprintf(stderr, "could not map `%s': %s\n", fname,
+                    strerror(errno));
+            exit(1);
+        }
+        bits = (unsigned char*)m;
+        size = new_size;
+    }
+
+    const char *fname;
+    int fd;
+    unsigned char *bits;
+    size_t size;
+    unsigned long duplicates;
+};
+SeenIds *seenIds = NULL;
+
+// The parents of the items, from --id-file: an open addressing hash table of
+// 8 bytes per item, at most 3/4 full. It is in memory, or when it would take
+// more than idmap_memory, in an unlinked file in --tmpdir mapped in memory,
+// which the kernel can page out instead of running out of memory.
+class IdMap {
+public:
+    struct Entry {
+        unsigned first; // objectID, 0 for a free slot
+        unsigned second; // parent_id
+    };
+
+    IdMap() : slots(NULL), bits(0), count(0), fd(-1) {}
+    IdMap(IdMap &&other) : IdMap() { swap(other); }
+    IdMap &operator=(IdMap &&other)
+    {
+        swap(other);
+        return *this;
+    }
+    ~IdMap() { release(slots, bits, fd); }
+
+    // like unordered_map<unsigned, unsigned>, end() for a missing id
+    const Entry *find(unsigned id) const
+    {
+        if (!slots || !id)
+            return end();
+        for (size_t i = slot(id, bits); ; i = (i + 1) & mask(bits)) {
+            if (slots[i].first == id)
+                return &slots[i];
+            if (!slots[i].first)
+                return end();
+        }
+    }
+    const Entry *end() const { return NULL; }
+    size_t size() const { return count; }
+
+    // make room for n items
+    void reserve(size_t n)
+    {
+        while (!slots || n * 4 > (mask(bits) + 1) * 3)
+            grow(slots ? bits + 1 : 16);
+    }
+
+    // add an item, if it isn't there already
+    void insert(unsigned id, unsigned parent)
+    {
+        if (!id)
+            return;
+        reserve(count + 1);
+        if (put(slots, bits, id, parent))
+            ++count;
+    }
+
+    void printStats() const
+    {
+        fprintf(stderr, "id map %zu items, %zu MB %s\n", count,
+                (mask(bits) + 1) * sizeof(Entry) >> 20,
+                fd >= 0 ? "on disk" : "in memory");
+    }
+
+private:
+    static size_t mask(int bits) { return ((size_t)1 << bits) - 1; }
+
+    // HN ids are dense: runs of 8 consecutive ids share a cache line, and
+    // the runs are spread with Fibonacci hashing
+    static size_t slot(unsigned id, int bits)
+    {
+        return (id >> 3) * 0x9e3779b97f4a7c15ULL >> (67 - bits) << 3 | (id & 7);
+    }
+
+    static bool put(Entry *slots, int bits, unsigned id, unsigned parent)
+    {
+        size_t i = slot(id, bits);
+        while (slots[i].first && slots[i].first != id)
+            i = (i + 1) & mask(bits);
+        if (slots[i].first)
+            return false;
+        slots[i].first = id;
+        slots[i].second = parent;
+        return true;
+    }
+
+    void grow(int new_bits)
+    {
+        size_t len = (mask(new_bits) + 1) * sizeof(Entry);
+        int new_fd = -1;
+        Entry *new_slots;
+        if (idmap_memory && len > idmap_memory) {
+            char tmpl[PATH_MAX];
+            snprintf(tmpl, sizeof tmpl, "%s/hn2mbox-XXXXXX", tmpdir);
+            new_fd = mkstemp(tmpl);
+            if (new_fd < 0 || unlink(tmpl) || ftruncate(new_fd, len)) {
+                fprintf(stderr, "could not create a temporary file in `%s': "
+                        "%s\n", tmpdir, strerror(errno));
+                exit(1);
+            }
+            void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           new_fd, 0);
+            if (m == MAP_FAILED) {
+                fprintf(stderr, "could not map the id map: %s\n",
+                        strerror(errno));
+                exit(1);
+            }
+            new_slots = (Entry*)m;
+        } else {
+            new_slots = (Entry*)calloc(mask(new_bits) + 1, sizeof(Entry));
+            if (!new_slots) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        for (size_t i = 0; slots && i <= mask(bits); ++i)
+            if (slots[i].first)
+                put(new_slots, new_bits, slots[i].first, slots[i].second);
+        release(slots, bits, fd);
+        slots = new_slots;
+        bits = new_bits;
+        fd = new_fd;
+    }
+
+    static void release(Entry *slots, int bits, int fd)
+    {
+        if (fd >= 0) {
+            munmap(slots, (mask(bits) + 1) * sizeof(Entry));
+            close(fd);
+        } else {
+            free(slots);
+        }
+    }
+
+    void swap(IdMap &other)
+    {
+        std::swap(slots, other.slots);
+        std::swap(bits, other.bits);
+        std::swap(count, other.count);
+        std::swap(fd, other.fd);
+    }
+
+    Entry *slots;
+    int bits; // log2 of the number of slots
+    size_t count;
+    int fd; // of the file with the slots, -1 if in memory
+};
+
+// A day of the proleptic Gregorian calendar
+struct CivilDate {
+    long year;
+    unsigned month; // 1 to 12
+    unsigned day;   // 1 to 31
+};
+
+// Conversions between dates and days since 1970-01-01, see
+// http://howardhinnant.github.io/date_algorithms.html
+CivilDate civilFromDays(long z)
+{
+    z += 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = z - era * 146097;
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned d = doy - (153 * mp + 2) / 5 + 1;
+    unsigned m = mp < 10 ? mp + 3 : mp - 9;
+    return { (long)yoe + era * 400 + (m <= 2), m, d };
+}
+
+long daysFromCivil(long y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = y - era * 400;
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+// days since 1970-01-01 of a timestamp, rounding down
+long daysFromTime(time_t t)
+{
+    return t >= 0 ? t / 86400 : (t - 86399) / 86400;
+}
+
+// the time of a created_at string like 2014-03-01T12:34:56.000Z, -1 if it
+// doesn't look like that
+time_t parseCreatedAt(const char *s, size_t len)
+{
+    unsigned y, mo, d, h, mi, sec;
+    if (len < 19 || sscanf(s, "%4u-%2u-%2uT%2u:%2u:%2u",
+                           &y, &mo, &d, &h, &mi, &sec) != 6)
+        return -1;
+    return (time_t)daysFromCivil(y, mo, d) * 86400 + h * 3600 + mi * 60 + sec;
+}
+
+// ISO 8601 week of a day: year and week number, as strftime's %G and %V
+void isoWeek(long days, long *year, unsigned *week)
+{
+    // a week belongs to the year of its Thursday, 1970-01-05 was a Monday
+    long thursday = days - ((days - 4) % 7 + 7) % 7 + 3;
+    *year = civilFromDays(thursday).year;
+    *week = (thursday - daysFromCivil(*year, 1, 1)) / 7 + 1;
+}
+
+// Format t as an RFC 5322 date in UTC, with the same output as
+// strftime("%a, %d %b %Y %T %z") in the C locale. The part up to the time of
+// the day is cached per thread, so it is only recomputed when the day
+// changes. buf must have room for 32 chars, return the length of the date.
+size_t formatDate(time_t t, char *buf)
+{
+    static const char days[] = "ThuFriSatSunMonTueWed";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static thread_local long cached_day = numeric_limits<long>::min();
+    static thread_local char prefix[24];
+    static thread_local size_t prefix_len;
+
+    long day = daysFromTime(t);
+    if (day != cached_day) {
+        CivilDate d = civilFromDays(day);
+        int n = snprintf(prefix, sizeof prefix, "%.3s, %02u %.3s %ld ",
+                         &days[3 * ((day % 7 + 7) % 7)], d.day,
+                         &months[3 * (d.month - 1)], d.year);
+        prefix_len = n > 0 && (size_t)n < sizeof prefix ? n : 0;
+        cached_day = day;
+    }
+    unsigned secs = t - day * 86400;
+    memcpy(buf, prefix, prefix_len);
+    char *p = buf + prefix_len;
+    unsigned fields[] = { secs / 3600, secs / 60 % 60, secs % 60 };
+    for (unsigned i = 0; i < 3; ++i) {
+        *p++ = '0' + fields[i] / 10;
+        *p++ = '0' + fields[i] % 10;
+        *p++ = i < 2 ? ':' : ' ';
+    }
+    memcpy(p, "+0000", 6);
+    return p + 5 - buf;
+}
+
+// Append data to out encoded as quoted-printable (RFC 2045). Newlines are
+// kept as hard line breaks, long lines are broken with soft line breaks and
+// whitespace before a line break is escaped. Runs of 16 bytes that need no
+// escaping are detected with SSE2 and copied as they are.
+void encodeQuotedPrintable(const char *data, size_t len, string &out)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    enum { max_line = 76 };
+    const unsigned char *p = (const unsigned char*)data;
+    const unsigned char *end = p + len;
+    unsigned col = 0;
+    out.reserve(out.size() + len + len / 8);
+
+    while (p < end) {
+#ifdef __SSE2__
+        // leave room for the soft line break
+        if (end - p >= 16 && col + 16 < max_line && col) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            // printable ASCII and space, but '='
+            __m128i ok = _mm_and_si128(
+                    _mm_cmpgt_epi8(v, _mm_set1_epi8(31)),
+                    _mm_cmplt_epi8(v, _mm_set1_epi8(127)));
+            ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')), ok);
+            unsigned mask = _mm_movemask_epi8(ok);
+            // copy up to the first byte that needs escaping, leaving a
+            // space or tab at the end to see what follows it
+            unsigned n = mask == 0xffff ? 16 : __builtin_ctz(~mask);
+            if (n && (p[n - 1] == ' ' || p[n - 1] == '\t'))
+                --n;
+            out.append((const char*)p, n);
+            p += n;
+            col += n;
+            if (n == 16)
+                continue;
+        }
+#endif
+        unsigned char c = *p;
+        if (c == '\n') {
+            out += '\n';
+            col = 0;
+            ++p;
+            continue;
+        }
+        bool last = p + 1 == end || p[1] == '\n';
+        bool literal = (c >= 33 && c <= 126 && c != '=')
+                    || ((c == ' ' || c == '\t') && !last);
+        // escape "From " at the start of a line, for mbox readers
+        if (c == 'F' && col == 0 && end - p >= 5 && !memcmp(p, "From ", 5))
+            literal = false;
+        unsigned width = literal ? 1 : 3;
+        // the last char of a line doesn't need room for a soft line break
+        if (col + width > max_line - (last ? 0 : 1)) {
+            out += "=\n";
+            col = 0;
+            continue;
+        }
+        if (literal) {
+            out += (char)c;
+        } else {
+            out += '=';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        col += width;
+        ++p;
+    }
+}
+
+// Append data to out encoded as base64 (RFC 2045), in lines of 76 chars
+void encodeBase64(const char *data, size_t len, string &out)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char*)data;
+    size_t pos = out.size();
+    out.resize(pos + (len + 2) / 3 * 4 + (len + 56) / 57);
+    char *o = &out[pos];
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned v = p[i] << 16;
+        if (i + 1 < len)
+            v |= p[i + 1] << 8;
+        if (i + 2 < len)
+            v |= p[i + 2];
+        *o++ = b64[v >> 18];
+        *o++ = b64[(v >> 12) & 63];
+        *o++ = i + 1 < len ? b64[(v >> 6) & 63] : '=';
+        *o++ = i + 2 < len ? b64[v & 63] : '=';
+        if ((i + 3) % 57 == 0 || i + 3 >= len)
+            *o++ = '\n';
+    }
+    out.resize(o - &out[0]);
+}
+
+// Quote the lines of out after begin matching /^>*From / with another '>',
+// as mboxrd readers expect. Lines are found with memchr(), which skips the
+// long body lines quickly, and escaping is rare, so the string is only
+// rebuilt when there is something to quote.
+void escapeFromLines(string &out, size_t begin)
+{
+    vector<size_t> quote;
+    const char *data = out.data();
+    const char *end = data + out.size();
+    for (const char *p = data + begin; p < end; ) {
+        const char *q = p;
+        while (q < end && *q == '>')
+            ++q;
+        if (end - q >= 5 && memcmp(q, "From ", 5) == 0)
+            quote.push_back(p - data);
+        p = (const char*)memchr(p, '\n', end - p);
+        if (!p)
+            break;
+        ++p;
+    }
+    if (quote.empty())
         return;
+
+    string escaped;
+    escaped.reserve(out.size() + quote.size());
+    size_t pos = 0;
+    for (size_t q : quote) {
+        escaped.append(out, pos, q - pos);
+        escaped += '>';
+        pos = q;
+    }
+    escaped.append(out, pos, string::npos);
+    out.swap(escaped);
+}
+
+// A --template, compiled to a list of ops so that rendering a message is a
+// single loop over them. {{field}} writes a field, {{field|html}} writes it
+// HTML escaped, {{#field}}...{{/field}} is written if the field isn't empty
+// or zero and {{^field}}...{{/field}} if it is.
+class Template {
+public:
+    // the fields that can be used, besides those of Item: subject is the
+    // title of the item or of its story, date the Date header and references
+    // the ids of the ancestors of a comment, as in the References header
+    enum class Field {
+        objectID, author, title, subject, date, created_at, url, points,
+        num_comments, story_id, story_title, story_url, parent_id,
+        story_text, comment_text, references,
+    };
+
+    // compile src, error messages refer to fname
+    Template(const string &src, const char *fname)
+    {
+        static const char *const names[] = {
+            "objectID", "author", "title", "subject", "date", "created_at",
+            "url", "points", "num_comments", "story_id", "story_title",
+            "story_url", "parent_id", "story_text", "comment_text",
+            "references",
+        };
+        vector<size_t> open; // sections not closed yet
+        size_t pos = 0;
+        while (pos < src.size()) {
+            size_t tag = src.find("{{", pos);
+            if (tag == string::npos)
+                tag = src.size();
+            if (tag > pos)
+                ops.push_back({ Op::literal, Field(), literals.size(),
+                                tag - pos });
+            literals.append(src, pos, tag - pos);
+            if (tag == src.size())
+                break;
+            size_t end = src.find("}}", tag);
+            if (end == string::npos)
+                error(fname, "unterminated {{");
+            string name = src.substr(tag + 2, end - tag - 2);
+            pos = end + 2;
+
+            Op op = { Op::value, Field(), 0, 0 };
+            if (!name.empty() && strchr("#^/", name[0])) {
+                op.type = name[0] == '#' ? Op::section
+                    : name[0] == '^' ? Op::inverted : Op::end;
+                name.erase(0, 1);
+            } else if (name.size() > 5
+                       && name.compare(name.size() - 5, 5, "|html") == 0) {
+                op.type = Op::html;
+                name.erase(name.size() - 5);
+            }
+            size_t f = 0;
+            while (f < sizeof names / sizeof *names && name != names[f])
+                ++f;
+            if (f == sizeof names / sizeof *names)
+                error(fname, ("unknown field `" + name + "'").c_str());
+            op.field = Field(f);
+
+            if (op.type == Op::section || op.type == Op::inverted) {
+                open.push_back(ops.size());
+            } else if (op.type == Op::end) {
+                if (open.empty() || ops[open.back()].field != op.field)
+                    error(fname, ("unexpected {{/" + name + "}}").c_str());
+                // a failed section test jumps past its end
+                ops[open.back()].arg = ops.size() + 1;
+                open.pop_back();
+            }
+            ops.push_back(op);
+        }
+        if (!open.empty())
+            error(fname, ("unclosed section `"
+                          + string(names[(int)ops[open.back()].field])
+                          + "'").c_str());
+    }
+
+    void render(const Item &item,
+                const IdMap &item_ids,
+                string &out) const
+    {
+        for (size_t pc = 0; pc < ops.size(); ++pc) {
+            const Op &op = ops[pc];
+            switch (op.type) {
+            case Op::literal:
+                out.append(literals, op.arg, op.len);
+                break;
+            case Op::value:
+                append(item, op.field, item_ids, out);
+                break;
+            case Op::html: {
+                static thread_local string raw;
+                raw.clear();
+                append(item, op.field, item_ids, raw);
+                appendHtmlEscaped(out, raw.data(), raw.size());
+                break;
+            }
+            case Op::section:
+                if (!isSet(item, op.field))
+                    pc = op.arg - 1;
+                break;
+            case Op::inverted:
+                if (isSet(item, op.field))
+                    pc = op.arg - 1;
+                break;
+            case Op::end:
+                break;
+            }
+        }
+    }
+
+private:
+    struct Op {
+        enum Type { literal, value, html, section, inverted, end } type;
+        Field field;
+        size_t arg; // literal offset, or where a section ends
+        size_t len; // literal length
+    };
+
+    static void error(const char *fname, const char *msg)
+    {
+        fprintf(stderr, "%s: %s\n", fname, msg);
+        exit(1);
+    }
+
+    static void appendUnsigned(string &out, unsigned long n)
+    {
+        char buf[24];
+        char *p = buf + sizeof buf;
+        do
+            *--p = '0' + n % 10;
+        while (n /= 10);
+        out.append(p, buf + sizeof buf - p);
+    }
+
+    // fields are written up to their first NUL, if any
+    static void appendString(string &out, const Text &s)
+    {
+        out += s.c_str();
+    }
+
+    static const Text &subject(const Item &item)
+    {
+        return item.title.empty() ? item.story_title : item.title;
+    }
+
+    static bool isSet(const Item &item, Field f)
+    {
+        switch (f) {
+        case Field::objectID:     return item.objectID;
+        case Field::author:       return !item.author.empty();
+        case Field::title:        return !item.title.empty();
+        case Field::subject:      return !subject(item).empty();
+        case Field::date:         return true;
+        case Field::created_at:   return !item.created_at.empty();
+        case Field::url:          return !item.url.empty();
+        case Field::points:       return item.points;
+        case Field::num_comments: return item.num_comments;
+        case Field::story_id:     return item.story_id;
+        case Field::story_title:  return !item.story_title.empty();
+        case Field::story_url:    return !item.story_url.empty();
+        case Field::parent_id:    return item.parent_id;
+        case Field::story_text:   return !item.story_text.empty();
+        case Field::comment_text: return !item.comment_text.empty();
+        case Field::references:   return item.parent_id;
+        }
+        return false;
+    }
+
+    static void append(const Item &item, Field f,
+                       const IdMap &item_ids,
+                       string &out)
+    {
+        switch (f) {
+        case Field::objectID:     appendUnsigned(out, item.objectID);     break;
+        case Field::author:       appendString(out, item.author);         break;
+        case Field::title:        appendString(out, item.title);          break;
+        case Field::subject:      appendString(out, subject(item));       break;
+        case Field::created_at:   appendString(out, item.created_at);     break;
+        case Field::url:          appendString(out, item.url);            break;
+        case Field::num_comments: appendUnsigned(out, item.num_comments); break;
+        case Field::story_id:     appendUnsigned(out, item.story_id);     break;
+        case Field::story_title:  appendString(out, item.story_title);    break;
+        case Field::story_url:    appendString(out, item.story_url);      break;
+        case Field::parent_id:    appendUnsigned(out, item.parent_id);    break;
+        case Field::story_text:   appendString(out, item.story_text);     break;
+        case Field::comment_text: appendString(out, item.comment_text);   break;
+        case Field::points:
+            if (item.points < 0)
+                out += '-';
+            appendUnsigned(out, abs((long)item.points));
+            break;
+        case Field::date: {
+            char datestr[32];
+            out.append(datestr, formatDate(item.created_at_i, datestr));
+            break;
+        }
+        case Field::references: {
+            if (!item.parent_id)
+                break;
+            static thread_local vector<unsigned> parents;
+            parents.assign(1, item.parent_id);
+            for (auto i = item_ids.find(item.parent_id);
+                    i != item_ids.end() && i->second;
+                    i = item_ids.find(i->second))
+                parents.push_back(i->second);
+            for (size_t i = parents.size(); i--; ) {
+                out += i + 1 == parents.size() ? "<" : " <";
+                appendUnsigned(out, parents[i]);
+                out += "@hndump>";
+            }
+            break;
+        }
+        }
+    }
+
+    vector<Op> ops;
+    string literals;
+};
+
+// the headers and body templates of --template
+Template *headers_template = NULL;
+Template *body_template = NULL;
+// for --rebuild to notice a changed template
+unsigned long long template_hash = 0;
+// for --rebuild to notice a changed --where or --match-any
+unsigned long long filter_hash = 0;
+
+// read a --template, the headers are separated from the body by an empty
+// line. Header lines left empty by a section are dropped.
+void readTemplate(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "could not open `%s': %s\n", fname, strerror(errno));
+        exit(1);
+    }
+    string src;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+        src.append(buf, n);
+    fclose(f);
+    for (char c : src)
+        template_hash = (template_hash ^ (unsigned char)c) * 0x100000001b3ULL;
+    size_t blank = src.find("\n\n");
+    if (blank == string::npos) {
+        fprintf(stderr, "%s: no empty line after the headers\n", fname);
+        exit(1);
+    }
+    headers_template = new Template(src.substr(0, blank + 1), fname);
+    // the body must end with a newline, see formatItem()
+    if (src.back() != '\n')
+        src += '\n';
+    body_template = new Template(src.substr(blank + 2), fname);
+}
+
+void appendTransferEncoding(string &out)
+{
+    if (body_encoding == BodyEncoding::qp)
+        out += "Content-Transfer-Encoding: quoted-printable\n";
+    else if (body_encoding == BodyEncoding::base64)
+        out += "Content-Transfer-Encoding: base64\n";
+}
+
+// the headers of a message without --template
+void formatHeaders(const Item &item,
+                   const IdMap &item_ids,
+                   string &out)
+{
+    char datestr[32];
+    datestr[formatDate(item.created_at_i, datestr)] = '\0';
+
+    appendf(out, "Message-ID: <%u@hndump>\n"
+            "From: %s <%s@hndump>\n"
+            "Subject: %s\n"
+            "Date: %s\n"
+            "Mime-Version: 1.0\n"
+            "Content-Type: text/html; charset=utf-8\n",
+            item.objectID,
+            item.author.c_str(), item.author.c_str(),
+            // FIXME: some items have neither title nor story_title
+            item.title.empty() ? item.story_title.c_str() : item.title.c_str(),
+            datestr);
+    appendTransferEncoding(out);
+
+    if (item.parent_id) { // this item is a comment
+        appendf(out, "In-Reply-To: <%u@hndump>\n", item.parent_id);
+        // https://wiki.mozilla.org/MailNews:Message_Threading
+        list<unsigned> parents;
+        parents.push_front(item.parent_id);
+        while (true) {
+            auto i = item_ids.find(parents.front());
+            if (i == item_ids.end() || i->second == 0)
+                break;
+            parents.push_front(i->second);
+        }
+        out += "References:";
+        for (auto p : parents)
+            appendf(out, " <%u@hndump>", p);
+        out += "\n";
+    }
+
+    appendf(out, "X-HackerNews-Link: https://news.ycombinator.com/item?id=%u\n",
+            item.objectID);
+    appendf(out, "X-HackerNews-Points: %d\n", item.points);
+    if (!item.url.empty())
+        appendf(out, "X-HackerNews-Url: %s\n", item.url.c_str());
+    if (item.story_id)
+        appendf(out, "X-HackerNews-Story-Link: "
+                "https://news.ycombinator.com/item?id=%u\n", item.story_id);
+    if (item.parent_id == 0) // this item is a story
+        appendf(out, "X-HackerNews-Num-Comments: %u\n", item.num_comments);
+}
+
+// the HTML body of a message without --template
+void formatBody(const Item &item, string &html)
+{
+    // fields are written up to their first NUL, if any
+    if (item.parent_id) { // this item is a comment
+        html += "<html>";
+        html += item.comment_text.c_str();
+        html += "</html>\n";
+    } else {
+        const char *url = item.url.c_str();
+        html += "<html><a href=\"";
+        html += url;
+        html += "\" rel=\"nofollow\">";
+        appendHtmlEscaped(html, url, strlen(url));
+        html += "</a><p>";
+        html += item.story_text.c_str();
+        html += "</html>\n";
+    }
+}
+
+// append item in mbox format to out
+void formatItem(const Item &item,
+                const IdMap &item_ids,
+                string &out)
+{
+    size_t begin = out.size();
+    if (format == Format::mbox)
+        out += "From \n";
+    if (headers_template) {
+        size_t headers = out.size();
+        headers_template->render(item, item_ids, out);
+        // a header in a section that isn't written leaves an empty line
+        size_t w = headers;
+        for (size_t r = headers; r < out.size(); ++r)
+            if (out[r] != '\n' || (w > headers && out[w - 1] != '\n'))
+                out[w++] = out[r];
+        out.resize(w);
+        appendTransferEncoding(out);
+    } else {
+        formatHeaders(item, item_ids, out);
+    }
+
+    // FIXME: We're cheating here because, according to RFC 5332, lines
+    // should not be longer than 998 chars. Use --body-encoding to split
+    // them (and escape lines starting with "From ").
+    size_t headers_end = out.size();
+    static thread_local string body;
+    string &html = body_encoding == BodyEncoding::none ? out : body;
+    if (body_encoding == BodyEncoding::none)
+        out += "\n";
+    else
+        body.clear();
+    if (body_template)
+        body_template->render(item, item_ids, html);
+    else
+        formatBody(item, html);
+
+    if (body_encoding == BodyEncoding::qp) {
+        out += "\n";
+        encodeQuotedPrintable(body.data(), body.size(), out);
+        // a template may render an empty body, or one without a final newline
+        if (body.empty() || body.back() != '\n')
+            out += "\n";
+    } else if (body_encoding == BodyEncoding::base64) {
+        out += "\n";
+        encodeBase64(body.data(), body.size(), out);
+    }
+
+    if (format == Format::mbox && mbox_variant == MboxVariant::mboxcl2) {
+        // the length of the body, but not of the empty line ending it
+        char header[48];
+        int n = snprintf(header, sizeof header, "Content-Length: %zu\n",
+                         out.size() - headers_end - 1);
+        out.insert(headers_end, header, n);
+    } else if (format == Format::mbox && mbox_variant == MboxVariant::mboxrd) {
+        // skip the "From " line starting the message
+        escapeFromLines(out, begin + 6);
+    }
+    out += "\n";
+}
+
+// what the writers need to know about a formatted message
+struct MessageInfo {
+    time_t date;
+    unsigned objectID;
+    unsigned parent_id;
+    unsigned story_id; // the root of the thread, objectID for stories
+};
+
+MessageInfo messageInfo(const Item &item,
+                        const IdMap &item_ids)
+{
+    unsigned story = item.parent_id ? item.story_id : item.objectID;
+    if (!story) {
+        // some comments lack story_id, look for the root in the id file
+        story = item.parent_id;
+        for (auto i = item_ids.find(story);
+                i != item_ids.end() && i->second;
+                i = item_ids.find(story))
+            story = i->second;
+    }
+    return { (time_t)item.created_at_i, item.objectID, item.parent_id, story };
+}
+
+// the bit of an Item field in the masks of the fields a Sink reads
+inline unsigned fieldBit(Element e) { return 1u << (int)e; }
+
+// the fields needed to place a message: dates, partition, threading
+const unsigned key_fields = fieldBit(Element::created_at)
+    | fieldBit(Element::created_at_i)
+    | fieldBit(Element::objectID) | fieldBit(Element::parent_id)
+    | fieldBit(Element::story_id);
+const unsigned all_fields = ~0u;
+// the fields read by the messages and the sinks
+unsigned fields_needed = all_fields;
+
+// An output fed by the conversion besides the messages, like --ids or
+// --jsonl. Items not needed by any of them or by the messages are not even
+// copied by the parser.
+class Sink {
+public:
+    virtual ~Sink() {}
+
+    // the Item fields this sink reads
+    virtual unsigned fields() const = 0;
+    // every item parsed, in input order, from the parser thread
+    virtual void parsed(const Item &) {}
+    // every item converted, from any formatter thread: append what is to
+    // be written to out
+    virtual void format(const Item &, string &) {}
+    // called with the output of format() in input order
+    virtual void write(const string &) {}
+    virtual void finish() {}
+    virtual void printStats() {}
+};
+vector<Sink*> sinks;
+
+// open an output file of a Sink, - for stdout
+FILE *openSinkFile(const char *fname)
+{
+    if (strcmp(fname, "-") == 0)
+        return stdout;
+    FILE *f = fopen(fname, "w");
+    if (!f) {
+        fprintf(stderr, "could not open `%s' for writing: %s\n", fname,
+                strerror(errno));
+        exit(1);
+    }
+    return f;
+}
+
+void closeSinkFile(FILE *f)
+{
+    if (f == stdout ? fflush(f) : fclose(f)) {
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// --ids: the id table of --dump-ids, for the items parsed that pass --where
+// and --match-any
+class IdsSink : public Sink {
+public:
+    explicit IdsSink(const char *fname) : file(openSinkFile(fname)) {}
+
+    unsigned fields() const { return key_fields; }
+
+    void parsed(const Item &item)
+    {
+        fprintf(file, "%u\t%u\n", item.objectID, item.parent_id);
+    }
+
+    void finish() { closeSinkFile(file); }
+
+private:
+    FILE *file;
+};
+
+// --jsonl: the items converted as JSON, one per line
+class JsonlSink : public Sink {
+public:
+    explicit JsonlSink(const char *fname) : file(openSinkFile(fname)) {}
+
+    unsigned fields() const { return all_fields; }
+
+    void format(const Item &item, string &out)
+    {
+        thread_local StringBuffer buf;
+        buf.Clear();
+        Writer<StringBuffer> w(buf);
+        w.StartObject();
+        w.String("objectID");
+        w.Uint(item.objectID);
+        w.String("created_at_i");
+        w.Uint(item.created_at_i);
+        field(w, "created_at", item.created_at);
+        field(w, "author", item.author);
+        if (!item.parent_id) {
+            field(w, "title", item.title);
+            field(w, "url", item.url);
+            field(w, "story_text", item.story_text);
+            w.String("points");
+            w.Int(item.points);
+            w.String("num_comments");
+            w.Uint(item.num_comments);
+        } else {
+            w.String("parent_id");
+            w.Uint(item.parent_id);
+            w.String("story_id");
+            w.Uint(item.story_id);
+            field(w, "story_title", item.story_title);
+            field(w, "story_url", item.story_url);
+            field(w, "comment_text", item.comment_text);
+        }
+        w.EndObject();
+        out.append(buf.GetString(), buf.GetSize());
+        out += '\n';
+    }
+
+    void write(const string &s)
+    {
+        if (fwrite(s.data(), 1, s.size(), file) != s.size()) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    void finish() { closeSinkFile(file); }
+
+private:
+    static void field(Writer<StringBuffer> &w, const char *key,
+                      const Text &value)
+    {
+        w.String(key);
+        w.String(value.c_str());
+    }
+
+    FILE *file;
+};
+
+// counters for the --stats option
+struct Stats {
+    atomic<unsigned long> items_parsed {0};
+    atomic<unsigned long> items_skipped {0}; // by --incremental or --rebuild
+    atomic<unsigned long> items_written {0};
+    atomic<unsigned long long> bytes_written {0};
+} stats;
+
+// A bounded FIFO shared by several threads. Pushing blocks while the queue is
+// full and popping blocks while it is empty, until close() is called.
+template<typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity)
+        : capacity(capacity), closed(false), max_depth(0), pushes(0),
+          depth_sum(0) {}
+
+    void push(T v)
+    {
+        unique_lock<mutex> lock(m);
+        not_full.wait(lock, [this] { return q.size() < capacity; });
+        q.push_back(move(v));
+        ++pushes;
+        depth_sum += q.size();
+        max_depth = max(max_depth, q.size());
+        not_empty.notify_one();
+    }
+
+    // return false once the queue is closed and drained
+    bool pop(T &v)
+    {
+        unique_lock<mutex> lock(m);
+        not_empty.wait(lock, [this] { return !q.empty() || closed; });
+        if (q.empty())
+            return false;
+        v = move(q.front());
+        q.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    void printStats(const char *name)
+    {
+        lock_guard<mutex> lock(m);
+        fprintf(stderr, "queue %-8s capacity %zu, max depth %zu, "
+                "avg depth %.2f\n", name, capacity, max_depth,
+                pushes ? (double)depth_sum / pushes : 0.0);
+    }
+
+private:
+    mutex m;
+    condition_variable not_empty, not_full;
+    deque<T> q;
+    size_t capacity;
+    bool closed;
+    // queue depth seen at each push, for --stats
+    size_t max_depth;
+    size_t pushes;
+    size_t depth_sum;
+};
+
+// Lock-free ring buffer with a single producer and a single consumer thread
+template<typename T, size_t N>
+class SpscQueue {
+public:
+    SpscQueue() : head(0), tail(0) {}
+
+    bool tryPush(const T &v)
+    {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == N)
+            return false;
+        slots[t % N] = v;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &v)
+    {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+            return false;
+        v = slots[h % N];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+    }
+
+private:
+    T slots[N];
+    atomic<size_t> head; // next slot to pop, only written by the consumer
+    atomic<size_t> tail; // next slot to push, only written by the producer
+};
+
+// A thread writing to a single output file in --split mode. Its producer
+// collects messages in chunks and passes them over an SPSC queue, so the
+// conversion thread only blocks if this very file falls far behind.
+class FileWriter {
+public:
+    enum { chunk_size = 1 << 16, nchunks = 16 };
+
+    explicit FileWriter(OutFile *file)
+        : file(file), cur(NULL), allocated(0), sleeping(false), max_depth(0)
+    {
+        t = thread(&FileWriter::run, this);
+    }
+
+    // called from the producer thread only
+    void write(const char *data, size_t len)
+    {
+        if (!cur)
+            cur = getChunk();
+        cur->append(data, len);
+        if (cur->size() >= chunk_size)
+            flush();
+    }
+
+    // write everything still queued and close the file
+    void close()
+    {
+        flush();
+        post(NULL);
+        t.join();
+        string *s;
+        while (free_chunks.tryPop(s))
+            delete s;
+        file->close();
+        delete file;
+    }
+
+    size_t maxDepth() const { return max_depth; }
+
+    unsigned long last_use;
+
+private:
+    void flush()
+    {
+        if (cur && !cur->empty())
+            post(cur);
+        cur = NULL;
+    }
+
+    void post(string *chunk)
+    {
+        while (!full_chunks.tryPush(chunk))
+            this_thread::yield();
+        max_depth = max(max_depth, full_chunks.size());
+        // order the push before reading the flag, see run()
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load()) {
+            lock_guard<mutex> lock(m);
+            wakeup.notify_one();
+        }
+    }
+
+    string *getChunk()
+    {
+        string *s;
+        while (!free_chunks.tryPop(s)) {
+            if (allocated < nchunks) {
+                ++allocated;
+                s = new string;
+                s->reserve(chunk_size + 4096);
+                return s;
+            }
+            this_thread::yield();
+        }
+        return s;
+    }
+
+    // the writer thread, a NULL chunk ends it
+    void run()
+    {
+        string *s;
+        while (true) {
+            if (!full_chunks.tryPop(s)) {
+                unique_lock<mutex> lock(m);
+                sleeping.store(true);
+                while (!full_chunks.tryPop(s))
+                    wakeup.wait(lock);
+                sleeping.store(false);
+            }
+            if (!s)
+                break;
+            file->write(s->data(), s->size());
+            s->clear();
+            free_chunks.tryPush(s); // cannot fail, there are only nchunks
+        }
+    }
+
+    OutFile *file;
+    thread t;
+    string *cur; // chunk being filled by the producer
+    unsigned allocated;
+    SpscQueue<string*, nchunks + 1> full_chunks; // +1 for the final NULL
+    SpscQueue<string*, nchunks> free_chunks;
+    atomic<bool> sleeping;
+    mutex m;
+    condition_variable wakeup;
+    size_t max_depth;
+};
+
+// The FileWriters of the --writers option, at most max_writers of them at a
+// time. When that limit is reached the least recently used one is closed and
+// its file is reopened later if needed.
+class FileWriters {
+public:
+    explicit FileWriters(unsigned max_writers)
+        : max_writers(max_writers), clock(0), last_part(NULL), last(NULL),
+          started(0), max_depth(0) {}
+
+    void write(const Partition *part, const char *data, size_t len)
+    {
+        if (!last || part != last_part) {
+            auto i = writers.find(part);
+            if (i == writers.end()) {
+                if (writers.size() == max_writers)
+                    retireOldest();
+                i = writers.insert(make_pair(part,
+                            new FileWriter(new OutFile(part->name)))).first;
+                ++started;
+            }
+            last_part = part;
+            last = i->second;
+            last->last_use = ++clock;
+        }
+        last->write(data, len);
+    }
+
+    void closeAll()
+    {
+        for (auto &w : writers)
+            retire(w.second);
+        writers.clear();
+        last = NULL;
+    }
+
+    void printStats()
+    {
+        fprintf(stderr, "file writers started %lu, max queue depth %zu\n",
+                started, max_depth);
+    }
+
+private:
+    void retireOldest()
+    {
+        auto oldest = writers.begin();
+        for (auto i = writers.begin(); i != writers.end(); ++i)
+            if (i->second->last_use < oldest->second->last_use)
+                oldest = i;
+        if (oldest->second == last)
+            last = NULL;
+        retire(oldest->second);
+        writers.erase(oldest);
+    }
+
+    void retire(FileWriter *w)
+    {
+        w->close();
+        max_depth = max(max_depth, w->maxDepth());
+        delete w;
+    }
+
+    unsigned max_writers;
+    unordered_map<const Partition*, FileWriter*> writers;
+    unsigned long clock;
+    const Partition *last_part;
+    FileWriter *last;
+    unsigned long started;
+    size_t max_depth;
+};
+
+// set up by the --writers option
+FileWriters *fileWriters = NULL;
+
+// create directory path, it is fine if it already exists
+void makeDir(const string &path)
+{
+    if (mkdir(path.c_str(), 0777) && errno != EEXIST) {
+        fprintf(stderr, "could not create directory `%s': %s\n",
+                path.c_str(), strerror(errno));
+        exit(1);
+    }
+}
+
+// Writes each message to its own file in a Maildir per --split partition (or
+// a single one named HN), using a pool of threads. Files are named after the
+// item date and id, so running the conversion again replaces them instead of
+// adding duplicates.
+class MaildirWriter {
+public:
+    enum { job_size = 1024 };
+
+    explicit MaildirWriter(unsigned nthreads)
+        : jobs(2 * nthreads), cur(NULL), files(0), syncs(0)
+    {
+        // every thread keeps the files of its job open until they are
+        // synced, in smaller groups if the limit of open files is too low
+        struct rlimit rl;
+        size_t want = nthreads * job_size + 64;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+            if (rl.rlim_cur < want) {
+                rl.rlim_cur = min<rlim_t>(want, rl.rlim_max);
+                setrlimit(RLIMIT_NOFILE, &rl);
+                getrlimit(RLIMIT_NOFILE, &rl);
+            }
+            sync_group = rl.rlim_cur > want ? job_size
+                : max<size_t>((rl.rlim_cur - 64) / nthreads, 1);
+        } else {
+            sync_group = 64;
+        }
+        for (unsigned i = 0; i < nthreads; ++i)
+            threads.emplace_back(&MaildirWriter::run, this);
+    }
+
+    // called from the conversion thread only
+    void write(const MessageInfo &info, const Partition *part,
+               const char *data, size_t len)
+    {
+        auto d = dirs.find(part);
+        if (d == dirs.end()) {
+            string dir = part->name.empty() ? "HN" : part->name;
+            printd("new maildir: %s\n", dir.c_str());
+            makeDir(dir);
+            makeDir(dir + "/tmp");
+            makeDir(dir + "/new");
+            makeDir(dir + "/cur");
+            d = dirs.insert(make_pair(part, dir)).first;
+        }
+
+        if (!cur)
+            cur = new Job;
+        cur->files.push_back({ &d->second, info.date, info.objectID,
+                               cur->data.size(), len });
+        cur->data.append(data, len);
+        if (cur->files.size() == job_size) {
+            jobs.push(cur);
+            cur = NULL;
+        }
+    }
+
+    void finish()
+    {
+        if (cur)
+            jobs.push(cur);
+        cur = NULL;
+        jobs.close();
+        for (auto &t : threads)
+            t.join();
+    }
+
+    void printStats()
+    {
+        jobs.printStats("maildir");
+        fprintf(stderr, "maildir files %lu, sync batches %lu\n",
+                files.load(), syncs.load());
+    }
+
+private:
+    struct Job {
+        struct File {
+            const string *dir;
+            time_t date;
+            unsigned objectID;
+            size_t begin, len;
+        };
+        vector<File> files;
+        string data;
+    };
+
+    // Each job is written to tmp/ and its files are fdatasync()ed before
+    // they are moved to cur/. The tmp/ and cur/ directories that got new
+    // entries are then synced once per job.
+    void run()
+    {
+        Job *job;
+        vector<const string*> touched;
+        vector<int> fds;
+        char tmpname[PATH_MAX], curname[PATH_MAX];
+        while (jobs.pop(job)) {
+            touched.clear();
+            for (auto &f : job->files) {
+                snprintf(tmpname, sizeof tmpname, "%s/tmp/%lu.%u.hndump",
+                         f.dir->c_str(), (unsigned long)f.date, f.objectID);
+                int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0) {
+                    fprintf(stderr, "could not open `%s' for writing: %s\n",
+                            tmpname, strerror(errno));
+                    exit(1);
+                }
+                if (::write(fd, &job->data[f.begin], f.len) != (ssize_t)f.len) {
+                    fprintf(stderr, "write error: %s\n", strerror(errno));
+                    exit(1);
+                }
+                fds.push_back(fd);
+                if (fds.size() == sync_group)
+                    syncFiles(fds);
+                if (find(touched.begin(), touched.end(), f.dir) == touched.end())
+                    touched.push_back(f.dir);
+            }
+            syncFiles(fds);
+            for (auto dir : touched)
+                syncDir(*dir + "/tmp");
+            for (auto &f : job->files) {
+                snprintf(tmpname, sizeof tmpname, "%s/tmp/%lu.%u.hndump",
+                         f.dir->c_str(), (unsigned long)f.date, f.objectID);
+                snprintf(curname, sizeof curname, "%s/cur/%lu.%u.hndump:2,",
+                         f.dir->c_str(), (unsigned long)f.date, f.objectID);
+                if (rename(tmpname, curname)) {
+                    fprintf(stderr, "could not rename `%s': %s\n",
+                            tmpname, strerror(errno));
+                    exit(1);
+                }
+            }
+            for (auto dir : touched)
+                syncDir(*dir + "/cur");
+            files += job->files.size();
+            ++syncs;
+            delete job;
+        }
+    }
+
+    // flush the data of the files written and close them
+    static void syncFiles(vector<int> &fds)
+    {
+        for (int fd : fds)
+            if (fdatasync(fd) || close(fd)) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+        fds.clear();
+    }
+
+    static void syncDir(const string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0 || fsync(fd)) {
+            fprintf(stderr, "could not sync `%s': %s\n",
+                    path.c_str(), strerror(errno));
+            exit(1);
+        }
+        close(fd);
+    }
+
+    BlockingQueue<Job*> jobs;
+    vector<thread> threads;
+    Job *cur; // job being filled by the conversion thread
+    size_t sync_group; // max files a thread keeps open before syncing them
+    // Maildir path of each partition, only touched by the conversion thread.
+    // Jobs point into it, and map nodes are never moved.
+    unordered_map<const Partition*, string> dirs;
+    atomic<unsigned long> files;
+    atomic<unsigned long> syncs;
+};
+
+// set up by --format=maildir
+MaildirWriter *maildirWriter = NULL;
+
+#ifdef HAVE_ZSTD
+// little endian integers of the zstd seekable format
+void putLE32(string &out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        out += (char)(v >> (8 * i));
+}
+
+uint32_t getLE32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Zstandard seekable format, see
+// https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+enum : uint32_t {
+    zstd_skippable_magic = 0x184D2A5E,
+    zstd_seekable_magic = 0x8F92EAB1,
+    zstd_seek_footer_size = 9,
+};
+
+// compressed and decompressed size of each frame
+typedef vector<pair<uint32_t, uint32_t>> SeekTable;
+
+// Read the seek table at the end of a seekable zstd file. Return the size
+// of the skippable frame holding it, or 0 if the file has none.
+size_t readSeekTable(int fd, SeekTable &table)
+{
+    table.clear();
+    off_t size = lseek(fd, 0, SEEK_END);
+    unsigned char footer[zstd_seek_footer_size];
+    if (size < 8 + zstd_seek_footer_size
+            || pread(fd, footer, sizeof footer, size - sizeof footer)
+                != sizeof footer
+            || getLE32(footer + 5) != zstd_seekable_magic)
+        return 0;
+    uint32_t nframes = getLE32(footer);
+    size_t entry_size = footer[4] & 0x80 ? 12 : 8;
+    size_t skippable = 8 + nframes * entry_size + zstd_seek_footer_size;
+    if ((off_t)skippable > size)
+        return 0;
+    vector<unsigned char> entries(nframes * entry_size);
+    if (pread(fd, entries.data(), entries.size(), size - skippable
+                + 8) != (ssize_t)entries.size())
+        return 0;
+    for (uint32_t i = 0; i < nframes; ++i)
+        table.push_back(make_pair(getLE32(&entries[i * entry_size]),
+                                  getLE32(&entries[i * entry_size + 4])));
+    return skippable;
+}
+
+// write(2) all of data, or exit
+void writeAll(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// A message range compressed as one independent zstd frame
+struct ZstdFrame {
+    struct ZstdFile *file;
+    size_t seq;
+    string data;
+    string compressed;
+    unsigned nmessages;
+    time_t min_date, max_date;
+    unsigned min_id, max_id;
+};
+
+// An mbox compressed in the zstd seekable format (--compress=zstd). Frames
+// may be compressed by any thread of the pool, they are written in order by
+// whichever thread completes the next one. In --split mode the frames are
+// also listed in a .frames file, one per line:
+//   frame  offset  size  mbox-offset  mbox-size  messages
+//   min-date  max-date  min-objectID  max-objectID
+struct ZstdFile {
+    ZstdFile(int fd, FILE *frames)
+        : fd(fd), frames(frames), offset(0), mbox_offset(0), cur(NULL),
+          next_seq(0), write_seq(0)
+    {
+        if (fd == 1) // stdout, possibly a pipe
+            return;
+        size_t skippable = readSeekTable(fd, table);
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (skippable) {
+            // appending to an existing file, drop its seek table
+            size -= skippable;
+            if (ftruncate(fd, size)) {
+                fprintf(stderr, "could not truncate seek table: %s\n",
+                        strerror(errno));
+                exit(1);
+            }
+            for (auto &e : table)
+                mbox_offset += e.second;
+        } else if (size > 0) {
+            fprintf(stderr, "cannot append to a compressed mbox without "
+                    "seek table\n");
+            exit(1);
+        }
+        offset = lseek(fd, size, SEEK_SET);
+    }
+
+    // called with m locked when frame f is compressed
+    void commit(ZstdFrame *f)
+    {
+        done[f->seq] = f;
+        for (auto i = done.begin(); i != done.end() && i->first == write_seq;
+                i = done.erase(i), ++write_seq) {
+            f = i->second;
+            writeAll(fd, f->compressed.data(), f->compressed.size());
+            if (frames)
+                fprintf(frames, "%zu\t%llu\t%zu\t%llu\t%zu\t%u\t%lu\t%lu\t"
+                        "%u\t%u\n", table.size(), (unsigned long long)offset,
+                        f->compressed.size(),
+                        (unsigned long long)mbox_offset, f->data.size(),
+                        f->nmessages, (unsigned long)f->min_date,
+                        (unsigned long)f->max_date, f->min_id, f->max_id);
+            table.push_back(make_pair(f->compressed.size(), f->data.size()));
+            offset += f->compressed.size();
+            mbox_offset += f->data.size();
+            delete f;
+        }
+        all_done.notify_all();
+    }
+
+    // wait for all frames, append the seek table and close the file
+    void close()
+    {
+        unique_lock<mutex> lock(m);
+        all_done.wait(lock, [this] { return write_seq == next_seq; });
+        string st;
+        putLE32(st, zstd_skippable_magic);
+        putLE32(st, table.size() * 8 + zstd_seek_footer_size);
+        for (auto &e : table) {
+            putLE32(st, e.first);
+            putLE32(st, e.second);
+        }
+        putLE32(st, table.size());
+        st += '\0'; // descriptor: no checksums
+        putLE32(st, zstd_seekable_magic);
+        writeAll(fd, st.data(), st.size());
+        if ((fd != 1 && ::close(fd))
+                || (frames && fclose(frames))) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    int fd;
+    FILE *frames;
+    SeekTable table;
+    off_t offset;             // where the next frame goes
+    unsigned long long mbox_offset;
+    ZstdFrame *cur;           // frame being filled by the conversion thread
+    size_t next_seq;          // number of frames handed to the pool
+    mutex m;
+    condition_variable all_done;
+    map<size_t, ZstdFrame*> done; // compressed frames not yet written
+    size_t write_seq;         // next frame to write
+};
+
+// The compressed mboxes of the --compress=zstd option and the thread pool
+// compressing their frames
+class ZstdWriter {
+public:
+    enum { max_frame_bytes = 4 << 20 };
+
+    ZstdWriter(unsigned nthreads, int level, unsigned frame_messages)
+        : level(level), frame_messages(frame_messages), queue(2 * nthreads),
+          last(NULL)
+    {
+        for (unsigned i = 0; i < nthreads; ++i)
+            threads.emplace_back(&ZstdWriter::run, this);
+    }
+
+    // called from the conversion thread only
+    void write(const MessageInfo &info, const Partition *part,
+               const char *data, size_t len)
+    {
+        if (!last || part != last_part) {
+            auto i = files.find(part);
+            if (i == files.end())
+                i = files.insert(make_pair(part, open(part))).first;
+            last_part = part;
+            last = i->second;
+        }
+
+        ZstdFrame *&f = last->cur;
+        if (!f) {
+            f = new ZstdFrame;
+            f->file = last;
+            f->seq = last->next_seq;
+            f->nmessages = 0;
+            f->min_date = f->max_date = info.date;
+            f->min_id = f->max_id = info.objectID;
+        }
+        f->data.append(data, len);
+        ++f->nmessages;
+        f->min_date = min(f->min_date, info.date);
+        f->max_date = max(f->max_date, info.date);
+        f->min_id = min(f->min_id, info.objectID);
+        f->max_id = max(f->max_id, info.objectID);
+        if (f->nmessages == frame_messages || f->data.size() >= max_frame_bytes)
+            submit(last);
+    }
+
+    void finish()
+    {
+        for (auto &f : files)
+            submit(f.second);
+        queue.close();
+        for (auto &t : threads)
+            t.join();
+        for (auto &f : files) {
+            f.second->close();
+            delete f.second;
+        }
+        files.clear();
+    }
+
+    void printStats() { queue.printStats("compress"); }
+
+private:
+    ZstdFile *open(const Partition *part)
+    {
+        if (part->name.empty())
+            return new ZstdFile(1, NULL);
+        string name = part->name + ".zst";
+        printd("new file: %s\n", name.c_str());
+        int fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0666);
+        FILE *frames = fopen((name + ".frames").c_str(), "a");
+        if (fd < 0 || !frames) {
+            fprintf(stderr, "could not open `%s' for writing: %s\n",
+                    name.c_str(), strerror(errno));
+            exit(1);
+        }
+        return new ZstdFile(fd, frames);
+    }
+
+    void submit(ZstdFile *file)
+    {
+        if (!file->cur)
+            return;
+        {
+            lock_guard<mutex> lock(file->m);
+            ++file->next_seq;
+        }
+        queue.push(file->cur);
+        file->cur = NULL;
+    }
+
+    void run()
+    {
+        ZSTD_CCtx *cctx = ZSTD_createCCtx();
+        ZstdFrame *f;
+        while (queue.pop(f)) {
+            f->compressed.resize(ZSTD_compressBound(f->data.size()));
+            size_t n = ZSTD_compressCCtx(cctx, &f->compressed[0],
+                                         f->compressed.size(), f->data.data(),
+                                         f->data.size(), level);
+            if (ZSTD_isError(n)) {
+                fprintf(stderr, "zstd error: %s\n", ZSTD_getErrorName(n));
+                exit(1);
+            }
+            f->compressed.resize(n);
+            lock_guard<mutex> lock(f->file->m);
+            f->file->commit(f);
+        }
+        ZSTD_freeCCtx(cctx);
+    }
+
+    int level;
+    unsigned frame_messages;
+    BlockingQueue<ZstdFrame*> queue;
+    vector<thread> threads;
+    unordered_map<const Partition*, ZstdFile*> files;
+    const Partition *last_part;
+    ZstdFile *last;
+};
+
+// set up by --compress=zstd
+ZstdWriter *zstdWriter = NULL;
+
+// Copy to stdout the messages of a seekable zstd mbox (--extract) with the
+// objectID given by --message, or in the --since/--until range. Frames that
+// can't hold any of them according to the .frames file are skipped without
+// decompressing them.
+int extractMessages(const char *fname, unsigned message)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "could not open `%s': %s\n", fname, strerror(errno));
+        return 1;
+    }
+    SeekTable table;
+    if (!readSeekTable(fd, table)) {
+        fprintf(stderr, "`%s' is not a seekable zstd file\n", fname);
+        return 1;
+    }
+
+    struct FrameRange {
+        time_t min_date, max_date;
+        unsigned min_id, max_id;
+    };
+    vector<FrameRange> ranges;
+    FILE *frames = fopen((string(fname) + ".frames").c_str(), "r");
+    if (frames) {
+        unsigned long n, min_date, max_date;
+        unsigned min_id, max_id;
+        while (fscanf(frames, "%lu %*u %*u %*u %*u %*u %lu %lu %u %u",
+                      &n, &min_date, &max_date, &min_id, &max_id) == 5
+                && n == ranges.size())
+            ranges.push_back({ (time_t)min_date, (time_t)max_date,
+                               min_id, max_id });
+        fclose(frames);
+        if (ranges.size() != table.size()) {
+            fprintf(stderr, "`%s.frames' doesn't match, ignoring it\n", fname);
+            ranges.clear();
+        }
+    }
+
+    string compressed, data;
+    off_t offset = 0;
+    for (size_t i = 0; i < table.size(); offset += table[i++].first) {
+        if (!ranges.empty()) {
+            const FrameRange &r = ranges[i];
+            if (message ? message < r.min_id || message > r.max_id
+                        : r.max_date < since || r.min_date >= until)
+                continue;
+        }
+        compressed.resize(table[i].first);
+        data.resize(table[i].second);
+        if (pread(fd, &compressed[0], compressed.size(), offset)
+                != (ssize_t)compressed.size()) {
+            fprintf(stderr, "read error: %s\n", strerror(errno));
+            return 1;
+        }
+        size_t n = ZSTD_decompress(&data[0], data.size(),
+                                   compressed.data(), compressed.size());
+        if (ZSTD_isError(n) || n != data.size()) {
+            fprintf(stderr, "corrupt frame %zu\n", i);
+            return 1;
+        }
+
+        // messages start with a "From " line, and no body line does
+        for (size_t begin = 0, end; begin < data.size(); begin = end) {
+            end = data.find("\nFrom \n", begin);
+            end = end == string::npos ? data.size() : end + 1;
+            const char *msg = &data[begin];
+            size_t len = end - begin;
+            const char *h = (const char*)memmem(msg, len, "\nMessage-ID: <", 14);
+            unsigned id = h ? strtoul(h + 14, NULL, 10) : 0;
+            if (message) {
+                if (id != message)
+                    continue;
+            } else {
+                h = (const char*)memmem(msg, len, "\nDate: ", 7);
+                struct tm date = {};
+                if (!h || !strptime(h + 7, "%a, %d %b %Y %T", &date))
+                    continue;
+                time_t dt = timegm(&date);
+                if (dt < since || dt >= until)
+                    continue;
+            }
+            fwrite(msg, 1, len, stdout);
+        }
+    }
+    close(fd);
+    return 0;
+}
+#endif // HAVE_ZSTD
+
+// Thunderbird summary file (.msf) of an output mbox, for the --msf option.
+// It is written in the Mork format, with the same tables Thunderbird creates
+// when it imports an mbox: a row per message keyed by its offset, a table per
+// thread and the folder info with the size and date of the mbox, which
+// Thunderbird checks to decide if the summary is up to date.
+// See https://developer.mozilla.org/docs/Mozilla/Tech/Mork/Structure and
+// comm-central's mailnews/db/msgdb/src/nsMsgDatabase.cpp
+class MsfWriter {
+public:
+    // Mork column and scope ids, written out in the header dictionary
+    enum Column {
+        col_msgs_scope = 0x80, col_subject, col_sender, col_message_id,
+        col_references, col_date, col_size, col_flags, col_numlines,
+        col_msg_thread_id, col_thread_parent, col_charset, col_msg_offset,
+        col_msgs_kind, col_threads_scope, col_thread_kind, col_thread_id,
+        col_thread_flags, col_thread_newest, col_children,
+        col_unread_children, col_thread_subject, col_thread_root,
+        col_info_scope, col_info_kind, col_num_msgs, col_num_new_msgs,
+        col_folder_size, col_expunged_bytes, col_folder_date,
+        col_high_water_key, col_mailbox_name, col_info_charset, col_version,
+    };
+
+    MsfWriter(const string &mbox, const string &msf)
+        : mbox(mbox), msf(msf), nmessages(0), high_water_key(0), valid(true)
+    {
+        file = fopen(msf.c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "could not open `%s' for writing: %s\n",
+                    msf.c_str(), strerror(errno));
+            exit(1);
+        }
+        static const char *const names[] = {
+            "ns:msg:db:row:scope:msgs:all", "subject", "sender",
+            "message-id", "references", "date", "size", "flags", "numLines",
+            "msgThreadId", "threadParent", "msgCharSet", "msgOffset",
+            "ns:msg:db:table:kind:msgs", "ns:msg:db:row:scope:threads:all",
+            "ns:msg:db:table:kind:thread", "threadId", "threadFlags",
+            "threadNewestMsgDate", "children", "unreadChildren",
+            "threadSubject", "threadRoot",
+            "ns:msg:db:row:scope:dbfolderinfo:all",
+            "ns:msg:db:table:kind:dbfolderinfo", "numMsgs", "numNewMsgs",
+            "folderSize", "expungedBytes", "folderDate", "highWaterKey",
+            "mailboxName", "charSet", "version",
+        };
+        fprintf(file, "// <!-- <mdb:mork:z v=\"1.4\"/> -->\n"
+                "< <(a=c)> // (f=iso-8859-1)");
+        for (size_t i = 0; i < sizeof names / sizeof *names; ++i)
+            fprintf(file, "%s(%zX=%s)", i % 4 ? "" : "\n  ",
+                    col_msgs_scope + i, names[i]);
+        fprintf(file, ">\n\n{1:^%X {(k^%X:c)(s=9)}\n",
+                col_msgs_scope, col_msgs_kind);
+    }
+
+    // Add the message at offset to the summary. Without info, its date is
+    // taken from the Date header.
+    void addMessage(unsigned long long offset, const char *msg, size_t len,
+                    const MessageInfo *info)
+    {
+        if (!valid)
+            return;
+        if (offset + len > 0xffffffffULL) {
+            // message keys are the 32 bit offsets of the messages
+            fprintf(stderr, "`%s' is too big for a .msf summary, "
+                    "not writing `%s'\n", mbox.c_str(), msf.c_str());
+            valid = false;
+            return;
+        }
+        unsigned key = offset;
+
+        const char *end = (const char*)memmem(msg, len, "\n\n", 2);
+        const char *body = end ? end + 2 : msg + len;
+        string headers(msg, body - msg);
+        unsigned objectID = strtoul(header(headers, "Message-ID: <").c_str(),
+                                    NULL, 10);
+        string subject = header(headers, "Subject: ");
+        time_t date;
+        if (info) {
+            date = info->date;
+        } else {
+            struct tm tm = {};
+            strptime(header(headers, "Date: ").c_str(), "%a, %d %b %Y %T", &tm);
+            date = timegm(&tm);
+        }
+        unsigned numlines = count(body, msg + len, '\n');
+
+        // join the thread of the nearest ancestor in this mbox
+        string refs = header(headers, "References: ");
+        const Message *parent = NULL;
+        for (size_t r = refs.rfind('<'); !parent && r != string::npos;
+                r = r ? refs.rfind('<', r - 1) : string::npos) {
+            auto i = messages.find(strtoul(&refs[r + 1], NULL, 10));
+            if (i != messages.end())
+                parent = &i->second;
+        }
+        unsigned thread_id = parent ? parent->thread_id : key;
+        Thread &thread = threads[thread_id];
+        if (!parent) {
+            thread.subject = subject;
+            thread.newest = 0;
+        }
+        thread.keys.push_back(key);
+        thread.newest = max(thread.newest, date);
+        messages[objectID] = { key, thread_id };
+
+        fprintf(file, "  [%X:^%X", key, col_msgs_scope);
+        putCell(col_subject, subject);
+        putCell(col_sender, header(headers, "From: "));
+        string id = header(headers, "Message-ID: <");
+        putCell(col_message_id, id.substr(0, id.find('>')));
+        if (!refs.empty())
+            putCell(col_references, refs);
+        fprintf(file, "(^%X=%lX)(^%X=%zX)(^%X=0)(^%X=%X)(^%X=%X)(^%X=%X)"
+                "(^%X=%llX)",
+                col_date, (unsigned long)date, col_size, len, col_flags,
+                col_numlines, numlines, col_msg_thread_id, thread_id,
+                col_thread_parent, parent ? parent->key : 0xffffffffu,
+                col_msg_offset, offset);
+        putCell(col_charset, "utf-8");
+        fprintf(file, "]\n");
+        ++nmessages;
+        high_water_key = key;
+    }
+
+    // Add the messages already in the mbox, if it is being appended to
+    void scanMbox(unsigned long long size)
+    {
+        if (!size)
+            return;
+        FILE *in = fopen(mbox.c_str(), "r");
+        if (!in)
+            return;
+        string msg;
+        char line[4096];
+        unsigned long long offset = 0;
+        // messages start with a "From " line, and no body line does
+        while (fgets(line, sizeof line, in) && offset + msg.size() < size) {
+            if (strcmp(line, "From \n") == 0 && !msg.empty()) {
+                addMessage(offset, msg.data(), msg.size(), NULL);
+                offset += msg.size();
+                msg.clear();
+            }
+            msg += line;
+        }
+        if (!msg.empty())
+            addMessage(offset, msg.data(), min<size_t>(msg.size(),
+                                                        size - offset), NULL);
+        fclose(in);
+    }
+
+    // Write the thread and folder info tables. Must be called once the mbox
+    // is closed.
+    void close(unsigned long long size)
+    {
+        fprintf(file, "}\n");
+        for (auto &t : threads) {
+            fprintf(file, "\n{%X:^%X {(k^%X:c)(s=9)[%X:^%X(^%X=%X)(^%X=0)"
+                    "(^%X=%lX)(^%X=%zX)(^%X=%zX)(^%X=%X)",
+                    t.first, col_threads_scope, col_thread_kind, t.first,
+                    col_threads_scope, col_thread_id, t.first,
+                    col_thread_flags, col_thread_newest,
+                    (unsigned long)t.second.newest, col_children,
+                    t.second.keys.size(), col_unread_children,
+                    t.second.keys.size(), col_thread_root, t.first);
+            putCell(col_thread_subject, t.second.subject);
+            fprintf(file, "]}");
+            for (size_t i = 0; i < t.second.keys.size(); ++i)
+                fprintf(file, "%s%X:^%X", i % 8 ? " " : "\n  ",
+                        t.second.keys[i], col_msgs_scope);
+            fprintf(file, "}\n");
+        }
+
+        struct stat st;
+        if (mbox.empty() ? fstat(1, &st) : stat(mbox.c_str(), &st))
+            st.st_mtime = 0;
+        const char *name = strrchr(mbox.c_str(), '/');
+        name = name ? name + 1 : mbox.c_str();
+        fprintf(file, "\n{1:^%X {(k^%X:c)(s=9)}\n  [1:^%X(^%X=%X)(^%X=0)"
+                "(^%X=%llX)(^%X=0)(^%X=%lX)(^%X=%X)",
+                col_info_scope, col_info_kind, col_info_scope, col_num_msgs,
+                nmessages, col_num_new_msgs, col_folder_size, size,
+                col_expunged_bytes, col_folder_date,
+                (unsigned long)st.st_mtime, col_high_water_key,
+                high_water_key);
+        putCell(col_mailbox_name, name);
+        putCell(col_info_charset, "UTF-8");
+        putCell(col_version, "1");
+        fprintf(file, "]}\n");
+
+        if (fclose(file)) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (!valid)
+            unlink(msf.c_str());
+    }
+
+private:
+    struct Message {
+        unsigned key;
+        unsigned thread_id;
+    };
+    struct Thread {
+        string subject;
+        time_t newest;
+        vector<unsigned> keys;
+    };
+
+    // value of the header starting with name, "" if missing
+    static string header(const string &headers, const char *name)
+    {
+        size_t n = strlen(name);
+        size_t pos = headers.compare(0, n, name) == 0 ? 0
+                   : headers.find(string("\n") + name);
+        if (pos == string::npos)
+            return "";
+        if (pos)
+            pos += 1;
+        size_t end = headers.find('\n', pos);
+        return headers.substr(pos + n, end == string::npos ? end : end - pos - n);
+    }
+
+    // write a Mork cell, escaping the value
+    void putCell(int column, const string &value)
+    {
+        fprintf(file, "(^%X=", column);
+        for (unsigned char c : value) {
+            if (c == ')' || c == '\\' || c == '$')
+                fprintf(file, "\\%c", c);
+            else if (c < 0x20 || c >= 0x80)
+                fprintf(file, "$%02X", c);
+            else
+                putc(c, file);
+        }
+        putc(')', file);
+    }
+
+    string mbox, msf;
+    FILE *file;
+    unsigned nmessages;
+    unsigned high_water_key;
+    bool valid;
+    unordered_map<unsigned, Message> messages; // key: objectID
+    map<unsigned, Thread> threads;             // key: thread root key
+};
+
+// Files written alongside an output mbox: the --offset-index with a line per
+// message:
+//   objectID  offset  length  created_at_i  parent_id
+// and the --msf Thunderbird summary. Offsets are those of the uncompressed
+// mbox, also with --compress.
+struct Sidecars {
+    unsigned long long offset; // where the next message goes in the mbox
+    FILE *idx;
+    MsfWriter *msf;
+};
+
+// filenames given with --offset-index and --msf for the unsplit output
+char *offsetindexfile = NULL;
+char *msffile = NULL;
+unordered_map<const Partition*, Sidecars> sidecars;
+
+// size of an existing output mbox, 0 if there is none
+unsigned long long mboxSize(const char *fname)
+{
+    struct stat st;
+#ifdef HAVE_ZSTD
+    if (zstd_level) {
+        int fd = open(fname, O_RDONLY);
+        SeekTable table;
+        unsigned long long size = 0;
+        if (fd >= 0 && readSeekTable(fd, table))
+            for (auto &e : table)
+                size += e.second;
+        if (fd >= 0)
+            close(fd);
+        return size;
+    }
+#endif
+    if (fname ? stat(fname, &st) : fstat(1, &st))
+        return 0;
+    return S_ISREG(st.st_mode) ? st.st_size : 0;
+}
+
+// record a message in the sidecar files of its mbox
+void sidecarMessage(const MessageInfo &info, const Partition *part,
+                    const char *data, size_t len)
+{
+    auto i = sidecars.find(part);
+    if (i == sidecars.end()) {
+        Sidecars s = { 0, NULL, NULL };
+        string name;
+        if (!part->name.empty()) {
+            name = part->name;
+            if (zstd_level)
+                name += ".zst";
+            s.offset = mboxSize(name.c_str());
+        } else {
+            s.offset = mboxSize(NULL);
+        }
+        if (flags & FLAG_OFFSET_INDEX) {
+            string idxname = name.empty() ? offsetindexfile : name + ".idx";
+            s.idx = fopen(idxname.c_str(), "a");
+            if (!s.idx) {
+                fprintf(stderr, "could not open `%s' for writing: %s\n",
+                        idxname.c_str(), strerror(errno));
+                exit(1);
+            }
+        }
+        if (flags & FLAG_MSF) {
+            s.msf = new MsfWriter(name, name.empty() ? msffile : name + ".msf");
+            s.msf->scanMbox(s.offset);
+        }
+        i = sidecars.insert(make_pair(part, s)).first;
+    }
+    Sidecars &s = i->second;
+    if (s.idx)
+        fprintf(s.idx, "%u\t%llu\t%zu\t%lu\t%u\n", info.objectID, s.offset,
+                len, (unsigned long)info.date, info.parent_id);
+    if (s.msf)
+        s.msf->addMessage(s.offset, data, len, &info);
+    s.offset += len;
+}
+
+// finish the sidecar files, once the mboxes are closed
+void closeSidecars()
+{
+    for (auto &i : sidecars) {
+        if (i.second.idx && fclose(i.second.idx)) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (i.second.msf) {
+            i.second.msf->close(i.second.offset);
+            delete i.second.msf;
+        }
+    }
+    sidecars.clear();
+}
+
+// Output for --split=thread: a mbox per story thread. There are far too many
+// of them to keep them all open, so messages are collected in a buffer per
+// thread and written in bulk, through a pool of at most max_open files.
+class ThreadFiles {
+public:
+    explicit ThreadFiles(unsigned max_open)
+        : max_open(max_open), buffered(0), flushes(0), opens(0) {}
+
+    void write(const Partition *part, const char *data, size_t len)
+    {
+        buffers[part].append(data, len);
+        buffered += len;
+        if (buffered > thread_buffer_memory)
+            flush();
+    }
+
+    void closeAll()
+    {
+        flush();
+        for (auto &f : lru)
+            if (fclose(f.second)) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+        lru.clear();
+        files.clear();
+    }
+
+    void printStats()
+    {
+        fprintf(stderr, "thread files flushed %lu times, %lu opens\n",
+                flushes, opens);
+    }
+
+private:
+    // write out all buffers, dropping them to give their memory back
+    void flush()
+    {
+        for (auto &b : buffers) {
+            FILE *f = open(b.first);
+            if (fwrite(b.second.data(), 1, b.second.size(), f)
+                    != b.second.size()) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+        buffers.clear();
+        buffered = 0;
+        ++flushes;
+    }
+
+    FILE *open(const Partition *part)
+    {
+        auto i = files.find(part);
+        if (i != files.end()) {
+            lru.splice(lru.begin(), lru, i->second);
+            return i->second->second;
+        }
+        if (lru.size() == max_open) {
+            if (fclose(lru.back().second)) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+            files.erase(lru.back().first);
+            lru.pop_back();
+        }
+        ++opens;
+        lru.push_front(make_pair(part, fopen(part->name.c_str(), "a")));
+        if (!lru.front().second) {
+            fprintf(stderr, "could not open `%s' for writing: %s\n",
+                    part->name.c_str(), strerror(errno));
+            exit(1);
+        }
+        files[part] = lru.begin();
+        return lru.front().second;
+    }
+
+    typedef list<pair<const Partition*, FILE*>> Lru;
+    unsigned max_open;
+    unordered_map<const Partition*, string> buffers;
+    size_t buffered;
+    Lru lru; // open files, most recently used first
+    unordered_map<const Partition*, Lru::iterator> files;
+    unsigned long flushes;
+    unsigned long opens;
+};
+
+// set up by --split=thread
+ThreadFiles *threadFiles = NULL;
+
+// Decides the output file of each message for the --split option: one file
+// per year, month, ISO week or story thread, optionally rotated every
+// split_size bytes.
+// File names only depend on the messages and the files already there, so
+// running the conversion again appends to the same files.
+class Partitioner {
+public:
+    Partitioner() : last_key(-1), last(NULL) {}
+
+    // the partition for a message of len bytes
+    Partition *get(const MessageInfo &info, size_t len)
+    {
+        long key = periodKey(info);
+        if (!last || key != last_key) {
+            auto i = periods.find(key);
+            if (i == periods.end())
+                i = periods.insert(make_pair(key, newPeriod(info))).first;
+            last_key = key;
+            last = &i->second;
+        }
+        Partition *part = last->cur;
+        if (split_size && part->size && part->size + len > split_size)
+            part = last->cur = newPartition(last->base, ++last->rotation);
+        part->size += len;
+        return part;
+    }
+
+    // the period (year, month, thread...) of a message, also a sort key
+    static long periodKey(const MessageInfo &info)
+    {
+        long days = daysFromTime(info.date);
+        switch (split) {
+        case Split::none:
+            return 0;
+        case Split::year:
+            return civilFromDays(days).year;
+        case Split::month: {
+            CivilDate d = civilFromDays(days);
+            return d.year * 12 + d.month;
+        }
+        case Split::week:
+            // 1970-01-01 was a Thursday, ISO weeks start on Monday
+            return (days + 3) / 7;
+        case Split::thread:
+            return info.story_id;
+        }
+        return 0;
+    }
+
+    // the file name of the period of a message, without rotation suffix
+    static string periodName(const MessageInfo &info)
+    {
+        char fname[100];
+        long days = daysFromTime(info.date);
+        CivilDate d = civilFromDays(days);
+        long week_year;
+        unsigned week;
+        switch (split) {
+        case Split::none:
+            strcpy(fname, "HN");
+            break;
+        case Split::year:
+            snprintf(fname, sizeof fname, "HN-%04ld", d.year);
+            break;
+        case Split::month:
+            snprintf(fname, sizeof fname, "HN-%04ld-%02u", d.year, d.month);
+            break;
+        case Split::week:
+            isoWeek(days, &week_year, &week);
+            snprintf(fname, sizeof fname, "HN-%04ld-W%02u", week_year, week);
+            break;
+        case Split::thread: {
+            // shard the threads in directories of at most 10000 ids
+            unsigned id = info.story_id;
+            snprintf(fname, sizeof fname, "HN-threads/%u/%02u/HN-%u",
+                     id / 1000000, id / 10000 % 100, id);
+            break;
+        }
+        }
+        return fname;
+    }
+
+private:
+    struct Period {
+        string base;       // file name without rotation suffix
+        unsigned rotation; // number of the current file for --split=size:N
+        Partition *cur;
+    };
+
+    Period newPeriod(const MessageInfo &info)
+    {
+        string fname = periodName(info);
+        if (split == Split::thread)
+            makeDirs(fname.substr(0, fname.rfind('/')));
+        Period p = { fname, 0, NULL };
+        if (split_size) {
+            // continue with the last file of a previous run
+            p.rotation = 1;
+            while (exists(partitionName(p.base, p.rotation + 1)))
+                ++p.rotation;
+        } else if (!(flags & FLAG_SPLIT_MBOX)) {
+            p.base = "";
+        }
+        p.cur = newPartition(p.base, p.rotation);
+        return p;
+    }
+
+    Partition *newPartition(const string &base, unsigned rotation)
+    {
+        string name = partitionName(base, rotation);
+        partitions.push_back({ name, 0 });
+        Partition *part = &partitions.back();
+        if (split_size && format == Format::mbox) {
+            const char *ext = zstd_level ? ".zst" : "";
+            part->size = mboxSize((name + ext).c_str());
+        }
+        return part;
+    }
+
+    static string partitionName(const string &base, unsigned rotation)
+    {
+        if (!rotation)
+            return base;
+        char suffix[16];
+        snprintf(suffix, sizeof suffix, ".%03u", rotation);
+        return base + suffix;
+    }
+
+    // create a directory and its parents, once
+    void makeDirs(const string &path)
+    {
+        if (!dirs.insert(path).second)
+            return;
+        size_t slash = path.rfind('/');
+        if (slash != string::npos)
+            makeDirs(path.substr(0, slash));
+        makeDir(path);
+    }
+
+    static bool exists(const string &base)
+    {
+        struct stat st;
+        const char *ext = zstd_level ? ".zst" : "";
+        return !stat((base + ext).c_str(), &st);
+    }
+
+    unordered_map<long, Period> periods;
+    deque<Partition> partitions; // never moved, sinks point into it
+    unordered_set<string> dirs;  // created for --split=thread
+    long last_key;
+    Period *last;
+} partitioner;
+
+// The newest message written to each output file, for --incremental. HN ids
+// only grow, so a message was written by a previous run if its id is not
+// newer than the mark of its file, and its date is before the --until of that
+// run. Dates jitter against ids around edits and resubmissions; they only let
+// the parser skip an item early when it is older than the newest date written
+// by more than date_jitter. The marks of the previous run, read from the state
+// file, decide what to skip; the new ones are collected apart by the writing
+// thread and saved at the end.
+class HighWater {
+public:
+    enum { date_jitter = 7 * 24 * 3600 };
+
+    explicit HighWater(const char *fname) : fname(fname)
+    {
+        FILE *f = fopen(fname, "r");
+        if (!f)
+            return;
+        long long date, limit;
+        unsigned id;
+        char name[PATH_MAX];
+        while (fscanf(f, "%lld %u %lld %4095[^\n]", &date, &id, &limit,
+                      name) == 4)
+            loaded[name] = { (time_t)date, id, (time_t)limit };
+        fclose(f);
+    }
+
+    // whether all messages dated date were surely written in a previous
+    // run, only known before the item is complete if its file depends on
+    // the date alone
+    bool olderThan(time_t date)
+    {
+        if (split == Split::thread)
+            return false;
+        const Mark *m = find({ date, 0, 0, 0 });
+        return m && date < m->date - date_jitter && date < m->until;
+    }
+
+    // whether the message was already written in a previous run
+    bool written(const MessageInfo &info)
+    {
+        const Mark *m = find(info);
+        return m && info.objectID <= m->objectID && info.date < m->until;
+    }
+
+    // called for every message written
+    void update(const MessageInfo &info)
+    {
+        auto i = marks.find(Partitioner::periodKey(info));
+        if (i == marks.end()) {
+            i = marks.insert(make_pair(Partitioner::periodKey(info),
+                        make_pair(Partitioner::periodName(info), Mark()))).first;
+            i->second.second = { info.date, info.objectID, until };
+        }
+        Mark &m = i->second.second;
+        m.date = max(m.date, info.date);
+        m.objectID = max(m.objectID, info.objectID);
+    }
+
+    void save()
+    {
+        for (auto &i : marks) {
+            auto j = loaded.insert(make_pair(i.second.first, i.second.second));
+            Mark &m = j.first->second, &n = i.second.second;
+            if (n.objectID > m.objectID)
+                m = { max(m.date, n.date), n.objectID, n.until };
+        }
+        string tmp = string(fname) + ".new";
+        FILE *f = fopen(tmp.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "could not open `%s' for writing: %s\n",
+                    tmp.c_str(), strerror(errno));
+            exit(1);
+        }
+        for (auto &i : loaded)
+            fprintf(f, "%lld %u %lld %s\n", (long long)i.second.date,
+                    i.second.objectID, (long long)i.second.until,
+                    i.first.c_str());
+        if (fclose(f) || rename(tmp.c_str(), fname)) {
+            fprintf(stderr, "could not write `%s': %s\n", fname,
+                    strerror(errno));
+            exit(1);
+        }
+    }
+
+private:
+    struct Mark {
+        time_t date; // newest date written
+        unsigned objectID; // newest id written
+        time_t until; // --until of the run that wrote it
+    };
+
+    // called from the parser thread only
+    const Mark *find(const MessageInfo &info)
+    {
+        long key = Partitioner::periodKey(info);
+        auto c = cache.find(key);
+        if (c == cache.end()) {
+            auto l = loaded.find(Partitioner::periodName(info));
+            c = cache.insert(make_pair(key,
+                        l == loaded.end() ? NULL : &l->second)).first;
+        }
+        return c->second;
+    }
+
+    const char *fname;
+    map<string, Mark> loaded; // by file name
+    unordered_map<long, const Mark*> cache; // loaded marks by period key
+    unordered_map<long, pair<string, Mark>> marks; // new marks by period key
+};
+HighWater *highWater = NULL;
+
+// Fingerprints of the items of each output file, for --rebuild. A quick
+// pre-scan of the input computes them, and only the files whose fingerprint
+// differs from the one saved by the previous run are written again.
+class Fingerprints {
+public:
+    explicit Fingerprints(const char *fname) : fname(fname), nchanged(0)
+    {
+        FILE *f = fopen(fname, "r");
+        if (!f)
+            return;
+        unsigned long long fp;
+        char name[PATH_MAX];
+        while (fscanf(f, "%llx %4095[^\n]", &fp, name) == 2)
+            old[name] = fp;
+        fclose(f);
+    }
+
+    // called by the pre-scan for every item to be written, in input order
+    void add(const MessageInfo &info, unsigned long long hash)
+    {
+        long key = Partitioner::periodKey(info);
+        auto i = periods.find(key);
+        if (i == periods.end()) {
+            i = periods.insert(make_pair(key, Period())).first;
+            i->second.name = Partitioner::periodName(info);
+            i->second.fp = options();
+        }
+        i->second.fp = (i->second.fp ^ hash) * 0x100000001b3ULL;
+    }
+
+    // after the pre-scan: delete the files to be written again
+    void removeChanged()
+    {
+        for (auto &i : periods) {
+            Period &p = i.second;
+            auto o = old.find(p.name);
+            p.changed = o == old.end() || o->second != p.fp;
+            if (!p.changed)
+                continue;
+            ++nchanged;
+            printd("rebuilding %s\n", p.name.c_str());
+            remove(p.name);
+            for (unsigned r = 1; ; ++r) {
+                char suffix[16];
+                snprintf(suffix, sizeof suffix, ".%03u", r);
+                if (!remove(p.name + suffix))
+                    break;
+            }
+        }
+    }
+
+    // whether all messages dated date go to an unchanged file, only known
+    // before the item is complete if its file depends on the date alone
+    bool unchangedDate(time_t date)
+    {
+        return split != Split::thread && unchanged({ date, 0, 0, 0 });
+    }
+
+    bool unchanged(const MessageInfo &info)
+    {
+        auto i = periods.find(Partitioner::periodKey(info));
+        return i != periods.end() && !i->second.changed;
+    }
+
+    void save()
+    {
+        for (auto &i : periods)
+            old[i.second.name] = i.second.fp;
+        string tmp = string(fname) + ".new";
+        FILE *f = fopen(tmp.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "could not open `%s' for writing: %s\n",
+                    tmp.c_str(), strerror(errno));
+            exit(1);
+        }
+        for (auto &i : old)
+            fprintf(f, "%016llx %s\n", i.second, i.first.c_str());
+        if (fclose(f) || rename(tmp.c_str(), fname)) {
+            fprintf(stderr, "could not write `%s': %s\n", fname,
+                    strerror(errno));
+            exit(1);
+        }
+    }
+
+    void printStats()
+    {
+        fprintf(stderr, "files rebuilt %u of %zu\n", nchanged, periods.size());
+    }
+
+private:
+    struct Period {
+        string name;
+        unsigned long long fp;
+        bool changed;
+    };
+
+    // the options that change the content of the files
+    static unsigned long long options()
+    {
+        return ((((unsigned long long)format * 3 + (int)body_encoding) * 3
+                 + (int)mbox_variant) * 3 + (int)sort_order) * 23 + zstd_level
+               + split_size * 0x9e3779b97f4a7c15ULL + template_hash
+               + filter_hash * 31;
+    }
+
+    // delete a mbox and what goes with it, return false if there was none
+    static bool remove(const string &base)
+    {
+        bool found = false;
+        for (const char *ext : { "", ".zst", ".zst.frames", ".idx", ".msf" })
+            found |= unlink((base + ext).c_str()) == 0;
+        return found;
+    }
+
+    const char *fname;
+    map<string, unsigned long long> old; // by file name
+    unordered_map<long, Period> periods;
+    unsigned nchanged;
+};
+Fingerprints *fingerprints = NULL;
+
+// write a formatted message to the file of its partition
+void emitMessage(const MessageInfo &info, const char *data, size_t len)
+{
+    Partition *part = partitioner.get(info, len);
+    if (highWater)
+        highWater->update(info);
+    if (flags & (FLAG_OFFSET_INDEX | FLAG_MSF))
+        sidecarMessage(info, part, data, len);
+    if (maildirWriter) {
+        maildirWriter->write(info, part, data, len);
+#ifdef HAVE_ZSTD
+    } else if (zstdWriter) {
+        zstdWriter->write(info, part, data, len);
+#endif
+    } else if (threadFiles) {
+        threadFiles->write(part, data, len);
+    } else if (fileWriters) {
+        fileWriters->write(part, data, len);
+    } else {
+        getFile(part)->write(data, len);
+    }
+    ++stats.items_written;
+    stats.bytes_written += len;
+}
+
+// Sorts records by a memcmp()ed key within a memory budget. The records are
+// collected in memory until they reach the budget, then sorted and spilled as
+// a run to an unlinked temporary file; at the end the runs are merged.
+class ExternalSorter {
+public:
+    explicit ExternalSorter(size_t memory)
+        : memory(memory), nrecords(0), spilled(0) {}
+
+    ~ExternalSorter()
+    {
+        for (FILE *f : runs)
+            fclose(f);
+    }
+
+    void add(const char *key, uint32_t keylen, const char *value, uint32_t len)
+    {
+        if (!recs.empty()
+                && buf.size() + recs.size() * sizeof(size_t) + keylen + len
+                    > memory)
+            spill();
+        recs.push_back(buf.size());
+        buf.append((const char*)&keylen, sizeof keylen);
+        buf.append((const char*)&len, sizeof len);
+        buf.append(key, keylen);
+        buf.append(value, len);
+        ++nrecords;
+    }
+
+    // call fn(key, keylen, value, len) for every record in key order, the
+    // pointers are only valid during the call
+    template<typename F>
+    void finish(F fn)
+    {
+        if (runs.empty()) {
+            sortBuffer();
+            for (size_t off : recs) {
+                const char *r = &buf[off];
+                fn(key(r), keyLen(r), key(r) + keyLen(r), valueLen(r));
+            }
+        } else {
+            spill();
+            merge(fn);
+        }
+        string().swap(buf);
+        vector<size_t>().swap(recs);
+    }
+
+    void printStats()
+    {
+        fprintf(stderr, "sorted %llu records, %zu runs, %llu bytes spilled\n",
+                nrecords, runs.size(), spilled);
+    }
+
+private:
+    static uint32_t keyLen(const char *r)
+    {
+        uint32_t n;
+        memcpy(&n, r, sizeof n);
+        return n;
+    }
+
+    static uint32_t valueLen(const char *r)
+    {
+        uint32_t n;
+        memcpy(&n, r + 4, sizeof n);
+        return n;
+    }
+
+    static const char *key(const char *r) { return r + 8; }
+
+    static int compare(const char *a, uint32_t alen,
+                       const char *b, uint32_t blen)
+    {
+        int c = memcmp(a, b, min(alen, blen));
+        return c ? c : (int)(alen > blen) - (int)(alen < blen);
+    }
+
+    void sortBuffer()
+    {
+        const char *base = buf.data();
+        stable_sort(recs.begin(), recs.end(), [base](size_t a, size_t b) {
+            const char *ra = base + a, *rb = base + b;
+            return compare(key(ra), keyLen(ra), key(rb), keyLen(rb)) < 0;
+        });
+    }
+
+    // write the buffered records as a sorted run
+    void spill()
+    {
+        sortBuffer();
+        char tmpl[PATH_MAX];
+        snprintf(tmpl, sizeof tmpl, "%s/hn2mbox-XXXXXX", tmpdir);
+        int fd = mkstemp(tmpl);
+        FILE *f = fd < 0 ? NULL : fdopen(fd, "w+");
+        if (!f) {
+            fprintf(stderr, "could not create a temporary file in `%s': %s\n",
+                    tmpdir, strerror(errno));
+            exit(1);
+        }
+        unlink(tmpl);
+        for (size_t off : recs) {
+            const char *r = &buf[off];
+            size_t n = 8 + keyLen(r) + valueLen(r);
+            if (fwrite(r, 1, n, f) != n) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+            spilled += n;
+        }
+        if (fflush(f)) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        rewind(f);
+        runs.push_back(f);
+        buf.clear();
+        recs.clear();
+        printd("spilled run %zu\n", runs.size());
+    }
+
+    struct Run {
+        FILE *file;
+        string rec; // current record
+    };
+
+    static bool next(Run &run)
+    {
+        char hdr[8];
+        if (fread(hdr, 1, 8, run.file) != 8)
+            return false;
+        size_t n = keyLen(hdr) + valueLen(hdr);
+        run.rec.assign(hdr, 8);
+        run.rec.resize(8 + n);
+        if (fread(&run.rec[8], 1, n, run.file) != n) {
+            fprintf(stderr, "temporary file truncated\n");
+            exit(1);
+        }
+        return true;
+    }
+
+    template<typename F>
+    void merge(F fn)
+    {
+        // share the budget among the read buffers of the runs
+        size_t bufsize = min(max(memory / runs.size(), (size_t)1 << 16),
+                             (size_t)1 << 20);
+        vector<Run> rs(runs.size());
+        // min-heap of runs by current key, ties go to the older run
+        auto greater = [&rs](size_t a, size_t b) {
+            const char *ra = rs[a].rec.data(), *rb = rs[b].rec.data();
+            int c = compare(key(ra), keyLen(ra), key(rb), keyLen(rb));
+            return c ? c > 0 : a > b;
+        };
+        vector<size_t> heap;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            rs[i].file = runs[i];
+            setvbuf(runs[i], NULL, _IOFBF, bufsize);
+            if (next(rs[i]))
+                heap.push_back(i);
+        }
+        make_heap(heap.begin(), heap.end(), greater);
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end(), greater);
+            Run &run = rs[heap.back()];
+            const char *r = run.rec.data();
+            fn(key(r), keyLen(r), key(r) + keyLen(r), valueLen(r));
+            if (next(run))
+                push_heap(heap.begin(), heap.end(), greater);
+            else
+                heap.pop_back();
+        }
+    }
+
+    size_t memory;
+    string buf;          // records: key length, value length, key, value
+    vector<size_t> recs; // offsets of the records in buf
+    vector<FILE*> runs;
+    unsigned long long nrecords;
+    unsigned long long spilled;
+};
+
+// append n to a sort key, most significant byte first
+void appendKey(string &key, unsigned long long n, int bytes)
+{
+    while (bytes--)
+        key += (char)(n >> bytes * 8);
+}
+
+// Reorders the messages for the --sort option before they are written
+class MessageSorter {
+public:
+    explicit MessageSorter(size_t memory) : sorter(memory) {}
+
+    void add(const MessageInfo &info, const char *data, size_t len)
+    {
+        // partition first, so each one is written in a single sweep
+        key.clear();
+        appendKey(key, Partitioner::periodKey(info) ^ 1ULL << 63, 8);
+        if (sort_order == Sort::date) {
+            appendKey(key, info.date ^ 1ULL << 63, 8);
+        } else {
+            // then thread, comments without a known story go with their
+            // parent
+            appendKey(key, info.story_id ? info.story_id : info.parent_id, 4);
+        }
+        appendKey(key, info.objectID, 4);
+        value.assign((const char*)&info, sizeof info);
+        value.append(data, len);
+        sorter.add(key.data(), key.size(), value.data(), value.size());
+    }
+
+    void finish()
+    {
+        sorter.finish([this](const char *k, uint32_t klen,
+                             const char *v, uint32_t vlen) {
+            MessageInfo info;
+            memcpy(&info, v, sizeof info);
+            if (sort_order == Sort::date) {
+                emitMessage(info, v + sizeof info, vlen - sizeof info);
+                return;
+            }
+            // collect a whole thread, they are small
+            if (klen < thread_key_len
+                    || memcmp(k, group_key.data(), thread_key_len))
+                flushThread();
+            group_key.assign(k, thread_key_len);
+            group.push_back({ info, group_data.size(), vlen - sizeof info });
+            group_data.append(v + sizeof info, vlen - sizeof info);
+        });
+        flushThread();
+    }
+
+    void printStats() { sorter.printStats(); }
+
+private:
+    enum { thread_key_len = 12 };
+
+    struct Entry {
+        MessageInfo info;
+        size_t offset; // of the message in group_data
+        size_t len;
+    };
+
+    // emit the collected thread depth first: each message is followed by
+    // its replies, the replies in id (i.e. date) order. Messages whose
+    // parent isn't in this partition start their own subtree.
+    void flushThread()
+    {
+        unordered_map<unsigned, size_t> index;
+        for (size_t i = 0; i < group.size(); ++i)
+            index[group[i].info.objectID] = i;
+        vector<vector<size_t>> replies(group.size());
+        vector<size_t> stack;
+        for (size_t i = group.size(); i--; ) {
+            auto p = index.find(group[i].info.parent_id);
+            if (group[i].info.parent_id && p != index.end() && p->second != i)
+                replies[p->second].push_back(i);
+            else
+                stack.push_back(i);
+        }
+        // replies were collected in reverse order, just right for the stack
+        while (!stack.empty()) {
+            size_t i = stack.back();
+            stack.pop_back();
+            const Entry &e = group[i];
+            emitMessage(e.info, &group_data[e.offset], e.len);
+            stack.insert(stack.end(), replies[i].begin(), replies[i].end());
+        }
+        group.clear();
+        group_data.clear();
+    }
+
+    ExternalSorter sorter;
+    string key, value;
+    string group_key;
+    vector<Entry> group;
+    string group_data;
+};
+MessageSorter *messageSorter = NULL;
+
+// write a formatted message, or hold it back for --sort
+void writeMessage(const MessageInfo &info, const char *data, size_t len)
+{
+    if (messageSorter)
+        messageSorter->add(info, data, len);
+    else
+        emitMessage(info, data, len);
+}
+
+// Split text into the terms of the --index option: runs of ASCII letters and
+// digits, lowercased, and of non ASCII UTF-8 bytes, at least two bytes long.
+// In HTML, tags and character references are skipped.
+template<typename F>
+void tokenize(const char *s, size_t len, bool html, F fn)
+{
+    enum { max_term = 64 };
+    char term[max_term];
+    size_t n = 0;
+    for (const char *end = s + len; ; ++s) {
+        unsigned char c = s < end ? *s : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            if (n < max_term)
+                term[n++] = tolower(c);
+            continue;
+        }
+        if (n >= 2)
+            fn(term, n);
+        n = 0;
+        if (s >= end)
+            break;
+        if (html && c == '<' && s + 1 < end
+                && (isalpha((unsigned char)s[1]) || s[1] == '/')) {
+            const char *gt = (const char*)memchr(s, '>', end - s);
+            s = gt ? gt : end - 1;
+        } else if (html && c == '&') {
+            const char *semi = (const char*)memchr(s, ';', min(end - s, 12L));
+            if (semi)
+                s = semi;
+        }
+    }
+}
+
+void putVarint(string &out, unsigned long long n)
+{
+    for (; n >= 0x80; n >>= 7)
+        out += (char)(n | 0x80);
+    out += (char)n;
+}
+
+unsigned long long getVarint(const unsigned char *&p)
+{
+    unsigned long long n = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char c = *p++;
+        n |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return n;
+    }
+}
+
+// Writes an index in DIR/NAME.terms, .idx and .postings. The terms file has
+// a record per term, in memcmp() order: term length (1 byte), term, number
+// of ids and offset of its posting list (varints). The idx file has the
+// offset of each record as 8 bytes little endian, for binary searches. A
+// posting list is the ascending objectIDs, delta coded as varints.
+class IndexWriter {
+public:
+    IndexWriter(const string &prefix) : prefix(prefix), postings_size(0)
+    {
+        terms = open(".terms");
+        idx = open(".idx");
+        postings = open(".postings");
+    }
+
+    void add(const char *term, size_t len, const vector<unsigned> &ids)
+    {
+        unsigned long long off = ftell(terms);
+        buf.clear();
+        for (int i = 0; i < 8; ++i)
+            buf += (char)(off >> i * 8);
+        write(idx, buf);
+        buf.assign(1, (char)len);
+        buf.append(term, len);
+        putVarint(buf, ids.size());
+        putVarint(buf, postings_size);
+        write(terms, buf);
+        buf.clear();
+        unsigned prev = 0;
+        for (unsigned id : ids) {
+            putVarint(buf, id - prev);
+            prev = id;
+        }
+        postings_size += buf.size();
+        write(postings, buf);
+    }
+
+    void close()
+    {
+        for (FILE *f : { terms, idx, postings })
+            if (fclose(f)) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                exit(1);
+            }
+    }
+
+private:
+    FILE *open(const char *ext)
+    {
+        string fname = prefix + ext;
+        FILE *f = fopen(fname.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "could not open `%s' for writing: %s\n",
+                    fname.c_str(), strerror(errno));
+            exit(1);
+        }
+        return f;
+    }
+
+    void write(FILE *f, const string &s)
+    {
+        if (fwrite(s.data(), 1, s.size(), f) != s.size()) {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    string prefix;
+    FILE *terms, *idx, *postings;
+    unsigned long long postings_size;
+    string buf;
+};
+
+// Reads an index written by IndexWriter, mapped in memory
+class IndexReader {
+public:
+    // return false if there is no such index
+    bool open(const string &prefix)
+    {
+        return map(prefix + ".terms", terms, terms_size)
+            && map(prefix + ".idx", idx, idx_size)
+            && map(prefix + ".postings", postings, postings_size);
+    }
+
+    ~IndexReader()
+    {
+        if (terms) munmap((void*)terms, terms_size);
+        if (idx) munmap((void*)idx, idx_size);
+        if (postings) munmap((void*)postings, postings_size);
+    }
+
+    size_t size() const { return idx_size / 8; }
+
+    // the i-th term, in order
+    string term(size_t i) const
+    {
+        const unsigned char *r = record(i);
+        return string((const char*)r + 1, r[0]);
+    }
+
+    // append the ids of the i-th term to ids
+    void ids(size_t i, vector<unsigned> &ids) const
+    {
+        const unsigned char *r = record(i);
+        r += 1 + r[0];
+        size_t n = getVarint(r);
+        const unsigned char *p = postings + getVarint(r);
+        unsigned id = 0;
+        while (n--)
+            ids.push_back(id += getVarint(p));
+    }
+
+    // the number of the term, or -1 if it isn't in the index
+    long find(const string &t) const
+    {
+        size_t lo = 0, hi = size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            const unsigned char *r = record(mid);
+            int c = memcmp(r + 1, t.data(), min((size_t)r[0], t.size()));
+            if (!c)
+                c = (int)r[0] - (int)t.size();
+            if (!c)
+                return mid;
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return -1;
+    }
+
+private:
+    const unsigned char *record(size_t i) const
+    {
+        unsigned long long off = 0;
+        for (int b = 8; b--; )
+            off = off << 8 | idx[i * 8 + b];
+        return terms + off;
+    }
+
+    static bool map(const string &fname, const unsigned char *&p, size_t &size)
+    {
+        p = NULL;
+        size = 0;
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED) {
+                fprintf(stderr, "could not map `%s': %s\n", fname.c_str(),
+                        strerror(errno));
+                exit(1);
+            }
+            p = (const unsigned char*)m;
+        }
+        ::close(fd);
+        return true;
+    }
+
+    const unsigned char *terms = NULL, *idx = NULL, *postings = NULL;
+    size_t terms_size = 0, idx_size = 0, postings_size = 0;
+};
+
+// Builds the --index. Each thread formatting messages collects the terms of
+// its items in a segment of its own, written to DIR when it grows too big.
+// At the end all the segments, and the index of a previous run, are merged
+// into DIR/hn.*.
+class IndexBuilder : public Sink {
+public:
+    explicit IndexBuilder(const string &dir) : dir(dir), nsegments(0) {}
+
+    unsigned fields() const
+    {
+        return key_fields | fieldBit(Element::title)
+            | fieldBit(Element::author) | fieldBit(Element::story_text)
+            | fieldBit(Element::comment_text);
+    }
+
+    void format(const Item &item, string &)
+    {
+        thread_local Segment *mine = NULL;
+        if (!mine) {
+            lock_guard<mutex> lock(m);
+            segments.push_back(mine = new Segment);
+        }
+        Segment *seg = mine;
+        unsigned id = item.objectID;
+        auto add = [seg, id](const char *t, size_t len) {
+            auto &ids = seg->terms[string(t, len)];
+            if (ids.empty())
+                seg->memory += len + 64;
+            if (ids.empty() || ids.back() != id) {
+                ids.push_back(id);
+                seg->memory += sizeof id;
+            }
+        };
+        tokenize(item.title.c_str(), strlen(item.title.c_str()), false, add);
+        tokenize(item.author.c_str(), strlen(item.author.c_str()), false, add);
+        tokenize(item.story_text.c_str(), strlen(item.story_text.c_str()),
+                 true, add);
+        tokenize(item.comment_text.c_str(), strlen(item.comment_text.c_str()),
+                 true, add);
+        if (seg->memory > index_memory)
+            flush(seg);
+    }
+
+    // merge everything in the final index
+    void finish()
+    {
+        for (Segment *seg : segments) {
+            flush(seg);
+            delete seg;
+        }
+        segments.clear();
+
+        vector<string> inputs;
+        for (unsigned i = 0; i < nsegments; ++i)
+            inputs.push_back(segmentName(i));
+        string final_name = dir + "/hn";
+        vector<IndexReader> readers(inputs.size() + 1);
+        if (readers.back().open(final_name))
+            inputs.push_back(final_name);
+        else
+            readers.pop_back();
+        for (size_t i = 0; i < inputs.size(); ++i)
+            if (!readers[i].open(inputs[i])) {
+                fprintf(stderr, "could not open `%s.terms': %s\n",
+                        inputs[i].c_str(), strerror(errno));
+                exit(1);
+            }
+
+        IndexWriter out(dir + "/hn.new");
+        vector<size_t> pos(readers.size(), 0);
+        vector<unsigned> ids;
+        for (;;) {
+            // the smallest term among the inputs
+            string t;
+            bool found = false;
+            for (size_t i = 0; i < readers.size(); ++i)
+                if (pos[i] < readers[i].size()) {
+                    string ti = readers[i].term(pos[i]);
+                    if (!found || ti < t)
+                        t = ti;
+                    found = true;
+                }
+            if (!found)
+                break;
+            ids.clear();
+            for (size_t i = 0; i < readers.size(); ++i)
+                if (pos[i] < readers[i].size()
+                        && readers[i].term(pos[i]) == t)
+                    readers[i].ids(pos[i]++, ids);
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+            out.add(t.data(), t.size(), ids);
+            ++nterms;
+        }
+        out.close();
+        readers.clear();
+
+        for (const char *ext : { ".terms", ".idx", ".postings" }) {
+            rename((dir + "/hn.new" + ext).c_str(),
+                   (final_name + ext).c_str());
+            for (unsigned i = 0; i < nsegments; ++i)
+                unlink((segmentName(i) + ext).c_str());
+        }
+    }
+
+    void printStats()
+    {
+        fprintf(stderr, "index segments %u, terms %zu\n", nsegments, nterms);
+    }
+
+private:
+    struct Segment {
+        unordered_map<string, vector<unsigned>> terms;
+        size_t memory = 0;
+    };
+
+    string segmentName(unsigned n)
+    {
+        char name[32];
+        snprintf(name, sizeof name, "/seg-%u", n);
+        return dir + name;
+    }
+
+    void flush(Segment *seg)
+    {
+        if (seg->terms.empty())
+            return;
+        vector<decltype(seg->terms)::value_type*> sorted;
+        for (auto &t : seg->terms)
+            sorted.push_back(&t);
+        sort(sorted.begin(), sorted.end(), [](decltype(sorted[0]) a,
+                                               decltype(sorted[0]) b) {
+            return a->first < b->first;
+        });
+        unsigned n;
+        {
+            lock_guard<mutex> lock(m);
+            n = nsegments++;
+        }
+        IndexWriter out(segmentName(n));
+        for (auto t : sorted) {
+            // a thread sees its items in input order, not in id order
+            auto &ids = t->second;
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+            out.add(t->first.data(), t->first.size(), ids);
+        }
+        out.close();
+        seg->terms.clear();
+        seg->memory = 0;
+    }
+
+    string dir;
+    mutex m;
+    vector<Segment*> segments;
+    unsigned nsegments;
+    size_t nterms = 0;
+};
+
+// the --search subcommand: print the ids of the items with all the terms
+int searchIndex(const char *dir, char **words, int nwords)
+{
+    IndexReader index;
+    if (!index.open(string(dir) + "/hn")) {
+        fprintf(stderr, "no index in `%s'\n", dir);
+        return 1;
+    }
+    vector<vector<unsigned>> lists;
+    for (int i = 0; i < nwords; ++i)
+        tokenize(words[i], strlen(words[i]), false,
+                 [&](const char *t, size_t len) {
+            lists.emplace_back();
+            long n = index.find(string(t, len));
+            if (n >= 0)
+                index.ids(n, lists.back());
+        });
+    if (lists.empty())
+        return 0;
+    // intersect starting with the shortest list
+    sort(lists.begin(), lists.end(),
+         [](const vector<unsigned> &a, const vector<unsigned> &b) {
+        return a.size() < b.size();
+    });
+    vector<unsigned> result = lists[0], tmp;
+    for (size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+        tmp.clear();
+        set_intersection(result.begin(), result.end(),
+                         lists[i].begin(), lists[i].end(), back_inserter(tmp));
+        result.swap(tmp);
+    }
+    for (unsigned id : result)
+        printf("%u\n", id);
+    return 0;
+}
+
+// output item in mbox format
+void dumpItemAsEmail(const Item &item,
+                     const IdMap &item_ids)
+{
+    if (!inDateRange(item)) {
+//        printd("date out of range %zu %zu %zu\n", since, dt, until);
+        return;
+    }
+
+    static string buf;
+    if (format != Format::none) {
+        buf.clear();
+        formatItem(item, item_ids, buf);
+        writeMessage(messageInfo(item, item_ids), buf.data(), buf.size());
+    }
+    for (Sink *sink : sinks) {
+        buf.clear();
+        sink->format(item, buf);
+        sink->write(buf);
+    }
+}
+
+// A run of consecutive input items travelling through the pipeline
+struct Batch {
+    size_t seq;
+    vector<Item> items;
+    // the texts of the items
+    Arena arena;
+    // the formatted messages, back to back, and where each of them ends
+    string out;
+    struct Message : MessageInfo {
+        Message(const MessageInfo &info, size_t end)
+            : MessageInfo(info), end(end) {}
+        size_t end;
+    };
+    vector<Message> messages;
+    // the output of each Sink
+    vector<string> sink_out;
+};
+
+// Parse -> format -> write pipeline used for --jobs > 1. The parser thread
+// hands batches of items to a pool of formatter threads. The writer thread
+// puts the formatted batches back in input order before writing them, so the
+// output is the same as dumpItemAsEmail()'s.
+class Pipeline {
+public:
+    enum { batch_size = 256 };
+
+    Pipeline(unsigned nformatters,
+             const IdMap &item_ids)
+        : item_ids(item_ids), format_queue(2 * nformatters),
+          write_queue(2 * nformatters), next_seq(0), cur(NULL),
+          max_reorder(0)
+    {
+        for (unsigned i = 0; i < nformatters; ++i)
+            formatters.emplace_back(&Pipeline::formatLoop, this);
+        writer = thread(&Pipeline::writeLoop, this);
+    }
+
+    // where the parser thread puts the texts of the items of the next batch
+    Arena &arena()
+    {
+        if (!cur) {
+            cur = new Batch;
+            cur->seq = next_seq++;
+            cur->items.reserve(batch_size);
+        }
+        return cur->arena;
+    }
+
+    // called by the parser thread for each complete item
+    void push(Item &&item)
+    {
+        arena();
+        cur->items.push_back(move(item));
+        if (cur->items.size() == batch_size) {
+            format_queue.push(cur);
+            cur = NULL;
+        }
+    }
+
+    // flush the last batch and wait for all of it to be written
+    void finish()
+    {
+        if (cur)
+            format_queue.push(cur);
+        cur = NULL;
+        format_queue.close();
+        for (auto &t : formatters)
+            t.join();
+        write_queue.close();
+        writer.join();
+    }
+
+    void printStats()
+    {
+        format_queue.printStats("format");
+        write_queue.printStats("write");
+        fprintf(stderr, "reorder buffer max depth %zu\n", max_reorder);
+    }
+
+private:
+    void formatLoop()
+    {
+        Batch *b;
+        while (format_queue.pop(b)) {
+            b->sink_out.resize(sinks.size());
+            for (auto &item : b->items) {
+                if (!inDateRange(item))
+                    continue;
+                if (format != Format::none) {
+                    formatItem(item, item_ids, b->out);
+                    b->messages.emplace_back(messageInfo(item, item_ids),
+                                             b->out.size());
+                }
+                for (size_t i = 0; i < sinks.size(); ++i)
+                    sinks[i]->format(item, b->sink_out[i]);
+            }
+            b->items.clear();
+            write_queue.push(b);
+        }
+    }
+
+    void writeLoop()
+    {
+        map<size_t, Batch*> pending;
+        size_t seq = 0;
+        Batch *b;
+        while (write_queue.pop(b)) {
+            pending[b->seq] = b;
+            max_reorder = max(max_reorder, pending.size());
+            for (auto i = pending.begin();
+                    i != pending.end() && i->first == seq;
+                    i = pending.erase(i), ++seq) {
+                b = i->second;
+                size_t begin = 0;
+                for (auto &m : b->messages) {
+                    writeMessage(m, &b->out[begin], m.end - begin);
+                    begin = m.end;
+                }
+                for (size_t i = 0; i < sinks.size(); ++i)
+                    sinks[i]->write(b->sink_out[i]);
+                delete b;
+            }
+        }
+    }
+
+    const IdMap &item_ids;
+    BlockingQueue<Batch*> format_queue;
+    BlockingQueue<Batch*> write_queue;
+    vector<thread> formatters;
+    thread writer;
+    size_t next_seq;
+    Batch *cur; // batch being filled by the parser
+    size_t max_reorder;
+};
+
+// A --where expression. It is compiled to a postfix program over a list of
+// tests on single fields. The parser reports each field as soon as it is
+// known, and the tests on it are done right then; the program runs with
+// three-valued logic, so an item is rejected as soon as the fields known so
+// far are enough, and the rest of it isn't even copied.
+//
+//   expr := term {"or" term}    term := factor {"and" factor}
+//   factor := "not" factor | "(" expr ")" | FIELD OP VALUE
+//           | FIELD "in" "{" VALUE {"," VALUE} "}" | FIELD "in" "@"FILE
+//
+// OP is one of == != < <= > >= and ~ (contains, ignoring ASCII case). VALUE
+// is a number or a "string". A @FILE has a value per line, up to the first
+// tab if any, so the output of --ids can be used.
+class Filter {
+public:
+    enum Result { no, yes, unknown };
+
+    explicit Filter(const char *expr) : p(expr), fieldmask(0)
+    {
+        parseOr();
+        skipSpace();
+        if (*p)
+            error("unexpected text");
+        results.resize(tests.size());
+        stack.resize(program.size());
+        hashProgram();
+    }
+
+    // the fields tested
+    unsigned fields() const { return fieldmask; }
+
+    // start with a new item
+    void reset() { fill(results.begin(), results.end(), unknown); }
+
+    // the field e of item is known now, return the result so far
+    Result known(Element e, const Item &item)
+    {
+        for (size_t i = 0; i < tests.size(); ++i)
+            if (tests[i].field == e)
+                results[i] = test(tests[i], item) ? yes : no;
+        return run();
+    }
+
+    // the item is complete: fields never seen keep their default values
+    bool matches(const Item &item)
+    {
+        for (size_t i = 0; i < tests.size(); ++i)
+            if (results[i] == unknown)
+                results[i] = test(tests[i], item) ? yes : no;
+        return run() == yes;
+    }
+
+private:
+    struct Test {
+        Element field;
+        enum { eq, ne, lt, le, gt, ge, contains, in } op;
+        bool numeric;
+        long long num;
+        string str;
+        unordered_set<long long> nums;
+        unordered_set<string> strs;
+    };
+
+    // the program: tests, or an operator on the results on the stack
+    enum { op_and = -1, op_or = -2, op_not = -3 };
+
+    // hash the compiled program into filter_hash, so spacing doesn't count
+    // but the contents of the @FILEs do
+    void hashProgram()
+    {
+        auto mix = [](const void *data, size_t len) {
+            for (size_t i = 0; i < len; ++i)
+                filter_hash = (filter_hash ^ ((const unsigned char*)data)[i])
+                    * 0x100000001b3ULL;
+        };
+        for (int insn : program) {
+            mix(&insn, sizeof insn);
+            if (insn < 0)
+                continue;
+            const Test &t = tests[insn];
+            int head[] = { (int)t.field, (int)t.op };
+            mix(head, sizeof head);
+            mix(&t.num, sizeof t.num);
+            mix(t.str.c_str(), t.str.size() + 1);
+            vector<long long> nums(t.nums.begin(), t.nums.end());
+            sort(nums.begin(), nums.end());
+            if (!nums.empty())
+                mix(&nums[0], nums.size() * sizeof nums[0]);
+            vector<string> strs(t.strs.begin(), t.strs.end());
+            sort(strs.begin(), strs.end());
+            for (const string &s : strs)
+                mix(s.c_str(), s.size() + 1);
+        }
+    }
+
+    Result run()
+    {
+        int top = 0;
+        for (int insn : program) {
+            if (insn >= 0) {
+                stack[top++] = (Result)results[insn];
+            } else if (insn == op_not) {
+                Result &r = stack[top - 1];
+                r = r == unknown ? unknown : r == yes ? no : yes;
+            } else {
+                Result b = stack[--top], &a = stack[top - 1];
+                if (insn == op_and)
+                    a = a == no || b == no ? no
+                        : a == yes && b == yes ? yes : unknown;
+                else
+                    a = a == yes || b == yes ? yes
+                        : a == no && b == no ? no : unknown;
+            }
+        }
+        return stack[0];
+    }
+
+    static bool test(const Test &t, const Item &item)
+    {
+        if (t.numeric) {
+            long long v = number(t.field, item);
+            switch (t.op) {
+            case Test::eq: return v == t.num;
+            case Test::ne: return v != t.num;
+            case Test::lt: return v < t.num;
+            case Test::le: return v <= t.num;
+            case Test::gt: return v > t.num;
+            case Test::ge: return v >= t.num;
+            case Test::in: return t.nums.count(v);
+            default:       return false;
+            }
+        }
+        // fields are compared up to their first NUL, if any
+        const char *v = text(t.field, item).c_str();
+        switch (t.op) {
+        case Test::eq: return strcmp(v, t.str.c_str()) == 0;
+        case Test::ne: return strcmp(v, t.str.c_str()) != 0;
+        case Test::lt: return strcmp(v, t.str.c_str()) < 0;
+        case Test::le: return strcmp(v, t.str.c_str()) <= 0;
+        case Test::gt: return strcmp(v, t.str.c_str()) > 0;
+        case Test::ge: return strcmp(v, t.str.c_str()) >= 0;
+        case Test::contains: return strcasestr(v, t.str.c_str());
+        case Test::in: return t.strs.count(v);
+        }
+        return false;
+    }
+
+    static long long number(Element e, const Item &item)
+    {
+        switch (e) {
+        case Element::points:       return item.points;
+        case Element::num_comments: return item.num_comments;
+        case Element::story_id:     return item.story_id;
+        case Element::parent_id:    return item.parent_id;
+        case Element::created_at_i: return item.created_at_i;
+        case Element::objectID:     return item.objectID;
+        default:                    return 0;
+        }
+    }
+
+    static const Text &text(Element e, const Item &item)
+    {
+        switch (e) {
+        case Element::created_at:   return item.created_at;
+        case Element::title:        return item.title;
+        case Element::url:          return item.url;
+        case Element::author:       return item.author;
+        case Element::story_text:   return item.story_text;
+        case Element::comment_text: return item.comment_text;
+        case Element::story_title:  return item.story_title;
+        default:                    return item.story_url;
+        }
+    }
+
+    void error(const char *msg)
+    {
+        fprintf(stderr, "invalid --where at `%s': %s\n", p, msg);
+        exit(1);
+    }
+
+    void skipSpace()
+    {
+        while (isspace((unsigned char)*p))
+            ++p;
+    }
+
+    // consume s if it comes next
+    bool accept(const char *s)
+    {
+        skipSpace();
+        size_t n = strlen(s);
+        if (strncmp(p, s, n) || (isalpha((unsigned char)s[0])
+                                 && isalnum((unsigned char)p[n])))
+            return false;
+        p += n;
+        return true;
+    }
+
+    string word()
+    {
+        skipSpace();
+        const char *begin = p;
+        while (isalnum((unsigned char)*p) || *p == '_')
+            ++p;
+        return string(begin, p);
+    }
+
+    void parseOr()
+    {
+        parseAnd();
+        while (accept("or")) {
+            parseAnd();
+            program.push_back(op_or);
+        }
+    }
+
+    void parseAnd()
+    {
+        parseNot();
+        while (accept("and")) {
+            parseNot();
+            program.push_back(op_and);
+        }
+    }
+
+    void parseNot()
+    {
+        if (accept("not")) {
+            parseNot();
+            program.push_back(op_not);
+        } else if (accept("(")) {
+            parseOr();
+            if (!accept(")"))
+                error("missing )");
+        } else {
+            parseTest();
+        }
+    }
+
+    void parseTest()
+    {
+        static const struct {
+            const char *name;
+            Element field;
+            bool numeric;
+        } fields[] = {
+            { "created_at",   Element::created_at,   false },
+            { "title",        Element::title,        false },
+            { "url",          Element::url,          false },
+            { "author",       Element::author,       false },
+            { "points",       Element::points,       true },
+            { "story_text",   Element::story_text,   false },
+            { "comment_text", Element::comment_text, false },
+            { "num_comments", Element::num_comments, true },
+            { "story_id",     Element::story_id,     true },
+            { "story_title",  Element::story_title,  false },
+            { "story_url",    Element::story_url,    false },
+            { "parent_id",    Element::parent_id,    true },
+            { "created_at_i", Element::created_at_i, true },
+            { "objectID",     Element::objectID,     true },
+        };
+        string name = word();
+        Test t;
+        size_t f = 0;
+        while (f < sizeof fields / sizeof *fields && name != fields[f].name)
+            ++f;
+        if (f == sizeof fields / sizeof *fields)
+            error("unknown field");
+        t.field = fields[f].field;
+        t.numeric = fields[f].numeric;
+        fieldmask |= fieldBit(t.field);
+
+        // longer operators first
+        static const struct {
+            const char *s;
+            decltype(t.op) op;
+        } ops[] = {
+            { "==", Test::eq }, { "!=", Test::ne }, { "<=", Test::le },
+            { ">=", Test::ge }, { "<", Test::lt }, { ">", Test::gt },
+            { "~", Test::contains }, { "in", Test::in },
+        };
+        size_t o = 0;
+        while (o < sizeof ops / sizeof *ops && !accept(ops[o].s))
+            ++o;
+        if (o == sizeof ops / sizeof *ops)
+            error("expected an operator");
+        t.op = ops[o].op;
+        if (t.op == Test::contains && t.numeric)
+            error("~ is only for text fields");
+
+        if (t.op != Test::in) {
+            value(t, t.num, t.str);
+        } else if (accept("@")) {
+            readSet(t);
+        } else if (accept("{")) {
+            do {
+                long long n = 0;
+                string s;
+                value(t, n, s);
+                if (t.numeric)
+                    t.nums.insert(n);
+                else
+                    t.strs.insert(s);
+            } while (accept(","));
+            if (!accept("}"))
+                error("missing }");
+        } else {
+            error("expected { or @");
+        }
+        program.push_back(tests.size());
+        tests.push_back(move(t));
+    }
+
+    void value(const Test &t, long long &n, string &s)
+    {
+        skipSpace();
+        if (t.numeric) {
+            char *end;
+            n = strtoll(p, &end, 10);
+            if (end == p)
+                error("expected a number");
+            p = end;
+        } else {
+            if (*p != '"')
+                error("expected a \"string\"");
+            const char *end = strchr(p + 1, '"');
+            if (!end)
+                error("unterminated string");
+            s.assign(p + 1, end);
+            p = end + 1;
+        }
+    }
+
+    void readSet(Test &t)
+    {
+        skipSpace();
+        const char *begin = p;
+        while (*p && !isspace((unsigned char)*p) && *p != ')')
+            ++p;
+        string fname(begin, p);
+        FILE *f = fopen(fname.c_str(), "r");
+        if (!f) {
+            fprintf(stderr, "could not open `%s': %s\n", fname.c_str(),
+                    strerror(errno));
+            exit(1);
+        }
+        char line[4096];
+        while (fgets(line, sizeof line, f)) {
+            line[strcspn(line, "\t\n")] = '\0';
+            if (t.numeric)
+                t.nums.insert(strtoll(line, NULL, 10));
+            else
+                t.strs.insert(line);
+        }
+        fclose(f);
+    }
+
+    const char *p; // parse position
+    unsigned fieldmask;
+    vector<Test> tests;
+    vector<int> program;
+    vector<char> results; // of the tests for the current item
+    vector<Result> stack;
+};
+Filter *filter = NULL;
+
+// The keywords of --match-any, one per line, matched ignoring ASCII case
+// anywhere in the texts. They are compiled into an Aho-Corasick automaton over
+// the classes of bytes that appear in some keyword. While the automaton is in
+// its start state, the text is skipped 16 bytes at a time to the next place
+// where a keyword could start: on CPUs with SSSE3 (checked at run time) by
+// looking up the first (up to 3) bytes of every keyword in nibble tables, like
+// Teddy, and otherwise with SSE2 by comparing with the first bytes of the
+// keywords when there are few of them.
+class Keywords {
+public:
+    explicit Keywords(const char *fname)
+    {
+        FILE *f = fopen(fname, "r");
+        if (!f) {
+            fprintf(stderr, "could not open `%s': %s\n", fname,
+                    strerror(errno));
+            exit(1);
+        }
+        char line[4096];
+        while (fgets(line, sizeof line, f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (!*line)
+                continue;
+            for (char *c = line; *c; ++c)
+                *c = tolower((unsigned char)*c);
+            words.push_back(line);
+        }
+        fclose(f);
+        if (words.empty()) {
+            fprintf(stderr, "no keywords in `%s'\n", fname);
+            exit(1);
+        }
+        // for --rebuild, in any order
+        vector<string> sorted(words);
+        sort(sorted.begin(), sorted.end());
+        for (const string &w : sorted)
+            for (const char *c = w.c_str(); c <= w.c_str() + w.size(); ++c)
+                filter_hash = (filter_hash ^ (unsigned char)*c)
+                    * 0x100000001b3ULL;
+        buildAutomaton();
+        buildPrefilter();
+        printd("%zu keywords, %zu states, %d byte classes\n", words.size(),
+                final.size(), nclasses);
+    }
+
+    bool matches(const char *s, size_t len) const
+    {
+        const unsigned char *p = (const unsigned char*)s, *end = p + len;
+        int state = 0;
+        while (p < end) {
+            if (state == 0 && (p = skip(p, end)) == end)
+                break;
+            state = delta[state * nclasses + cls[*p++]];
+            if (final[state])
+                return true;
+        }
+        return false;
+    }
+
+private:
+    void buildAutomaton()
+    {
+        memset(cls, 0, sizeof cls);
+        nclasses = 1; // 0 is for the bytes in no keyword
+        for (const string &w : words)
+            for (unsigned char c : w)
+                if (!cls[c])
+                    cls[c] = cls[toupper(c)] = nclasses++;
+
+        // the trie, then the failure transitions breadth first
+        delta.assign(nclasses, -1);
+        final.assign(1, false);
+        for (const string &w : words) {
+            int state = 0;
+            for (unsigned char c : w) {
+                int &next = delta[state * nclasses + cls[c]];
+                if (next < 0) {
+                    next = final.size();
+                    final.push_back(false);
+                    delta.resize(delta.size() + nclasses, -1);
+                }
+                state = delta[state * nclasses + cls[c]];
+            }
+            final[state] = true;
+        }
+        vector<int> fail(final.size()), queue(1, 0);
+        for (size_t q = 0; q < queue.size(); ++q) {
+            int state = queue[q];
+            for (int c = 0; c < nclasses; ++c) {
+                int &next = delta[state * nclasses + c];
+                int back = state ? delta[fail[state] * nclasses + c] : 0;
+                if (next < 0) {
+                    next = back;
+                } else {
+                    fail[next] = back;
+                    final[next] = final[next] || final[back];
+                    queue.push_back(next);
+                }
+            }
+        }
     }
 
-    struct tm *date = gmtime(&dt);
-    FILE *out = getFile(date);
-    if (!strftime(datestr, sizeof datestr, "%a, %d %b %Y %T %z", date))
-        *datestr = '\0';
+    void buildPrefilter()
+    {
+#ifdef __SSE2__
+        size_t minlen = words[0].size();
+        for (const string &w : words)
+            minlen = min(minlen, w.size());
+        // the bit of the keyword's bucket for its k-th byte, in both cases
+        fingerprint = min<size_t>(minlen, 3);
+        memset(lo, 0, sizeof lo);
+        memset(hi, 0, sizeof hi);
+        for (size_t i = 0; i < words.size(); ++i) {
+            for (size_t k = 0; k < fingerprint; ++k) {
+                unsigned char c = words[i][k], C = toupper(c);
+                lo[k][c & 15] |= 1 << i % 8;
+                hi[k][c >> 4] |= 1 << i % 8;
+                lo[k][C & 15] |= 1 << i % 8;
+                hi[k][C >> 4] |= 1 << i % 8;
+            }
+        }
+        teddy = __builtin_cpu_supports("ssse3");
 
-    fprintf(out, "From \n"
-            "Message-ID: <%u@hndump>\n"
-            "From: %s <%s@hndump>\n"
-            "Subject: %s\n"
-            "Date: %s\n"
-            "Mime-Version: 1.0\n"
-            "Content-Type: text/html; charset=utf-8\n",
-            item.objectID,
-            item.author.c_str(), item.author.c_str(),
-            // FIXME: some items have neither title nor story_title
-            item.title.empty() ? item.story_title.c_str() : item.title.c_str(),
-            datestr);
+        for (const string &w : words) {
+            unsigned char c = w[0], C = toupper(c);
+            if (find(first.begin(), first.end(), c) == first.end())
+                first.push_back(c);
+            if (find(first.begin(), first.end(), C) == first.end())
+                first.push_back(C);
+        }
+        if (first.size() > 8)
+            first.clear(); // not worth it
+#endif
+    }
 
-    if (item.parent_id) { // this item is a comment
-        fprintf(out, "In-Reply-To: <%u@hndump>\n", item.parent_id);
-        // https://wiki.mozilla.org/MailNews:Message_Threading
-        list<unsigned> parents;
-        parents.push_front(item.parent_id);
-        while (true) {
-            auto i = item_ids.find(parents.front());
-            if (i == item_ids.end() || i->second == 0)
-                break;
-            parents.push_front(i->second);
+    // the first place at or after p where a keyword could start, or a place
+    // close to the end of the text from where to go byte by byte
+    const unsigned char *skip(const unsigned char *p,
+            const unsigned char *end) const
+    {
+#ifdef __SSE2__
+        if (teddy)
+            return skipTeddy(p, end);
+        if (first.empty())
+            return p;
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            __m128i any = _mm_setzero_si128();
+            for (unsigned char c : first)
+                any = _mm_or_si128(any, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+            unsigned mask = _mm_movemask_epi8(any);
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
         }
-        fprintf(out, "References:");
-        for (auto p : parents)
-            fprintf(out, " <%u@hndump>", p);
-        fprintf(out, "\n");
+#endif
+        return p;
     }
 
-    fprintf(out, "X-HackerNews-Link: https://news.ycombinator.com/item?id=%u\n",
-            item.objectID);
-    fprintf(out, "X-HackerNews-Points: %d\n", item.points);
-    if (!item.url.empty())
-        fprintf(out, "X-HackerNews-Url: %s\n", item.url.c_str());
-    if (item.story_id)
-        fprintf(out, "X-HackerNews-Story-Link: "
-                "https://news.ycombinator.com/item?id=%u\n", item.story_id);
-    if (item.parent_id == 0) // this item is a story
-        fprintf(out, "X-HackerNews-Num-Comments: %u\n", item.num_comments);
+#ifdef __SSE2__
+    // skip() for CPUs with SSSE3, chosen at run time as the build only
+    // assumes SSE2
+    __attribute__((target("ssse3")))
+    const unsigned char *skipTeddy(const unsigned char *p,
+            const unsigned char *end) const
+    {
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        while (end - p >= ptrdiff_t(16 + fingerprint - 1)) {
+            __m128i r = _mm_set1_epi8(-1);
+            for (size_t k = 0; k < fingerprint; ++k) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(p + k));
+                __m128i l = _mm_shuffle_epi8(
+                        _mm_load_si128((const __m128i*)lo[k]),
+                        _mm_and_si128(v, nibble));
+                __m128i h = _mm_shuffle_epi8(
+                        _mm_load_si128((const __m128i*)hi[k]),
+                        _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+                r = _mm_and_si128(r, _mm_and_si128(l, h));
+            }
+            unsigned mask = _mm_movemask_epi8(
+                    _mm_cmpeq_epi8(r, _mm_setzero_si128())) ^ 0xffff;
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
+        }
+        return p;
+    }
+#endif
 
-    // FIXME: We're cheating here because, according to RFC 5332, lines
-    // should not be longer than 998 chars. But if we fix that by splitting
-    // long lines, then we should escape lines starting with "From "
-    // (perhaps formatting output as quoted-printable)
-    if (item.parent_id) // this item is a comment
-        fprintf(out, "\n"
-                "<html>%s</html>\n"
-                "\n",
-                item.comment_text.c_str());
-    else
-        fprintf(out, "\n"
-                "<html><a href=\"%s\" rel=\"nofollow\">%s</a><p>%s</html>\n"
-                "\n",
-                item.url.c_str(), htmlEncode(item.url).c_str(),
-                item.story_text.c_str());
-}
+    vector<string> words; // lowercase
+    unsigned char cls[256]; // byte classes
+    int nclasses;
+    vector<int> delta; // transitions, nclasses per state
+    vector<bool> final;
+#ifdef __SSE2__
+    bool teddy; // the CPU has SSSE3 for the lo and hi tables
+    size_t fingerprint; // bytes of the keywords in the tables
+    alignas(16) unsigned char lo[3][16], hi[3][16];
+    vector<unsigned char> first; // first bytes of the keywords, without SSSE3
+#endif
+};
+Keywords *keywords = NULL;
 
 template<typename Encoding = UTF8<>>
 struct ItemsHandler {
     typedef typename Encoding::Ch Ch;
 
-    ItemsHandler() : element(Element::none), parent(noparent), level(0), item {} {}
+    ItemsHandler() : element(Element::none), parent(noparent), level(0), item {},
+        skip_item(false), filtered_out(false), keyword_found(false),
+        pipeline(NULL), item_arena(&arena), item_mark(arena.mark())
+    {
+        if (filter)
+            filter->reset();
+    }
 
     void Default() {}
-    void Null() { element = Element::none; }
+    void Null()
+    {
+        // a null field is known to be empty
+        if (parent != _highlightResult && element != Element::none)
+            filterField();
+        element = Element::none;
+    }
     void Bool(bool) { Default(); }
     void Int(int i) { Int64(i); }
     void Uint(unsigned i) { Int64(i); }
@@ -227,6 +4761,7 @@ struct ItemsHandler {
         case Element::created_at_i:   item.created_at_i = i;  break;
         default:                      break;
         }
+        filterField();
 
         element = Element::none;
     }
@@ -273,13 +4808,36 @@ struct ItemsHandler {
             return;
         }
 
-        if (element == Element::none)
+        matchKeywords(str, length);
+        if (element == Element::none
+                || ((skip_item || filtered_out)
+                    && element != Element::objectID)
+                || !(fields_needed & fieldBit(element))) {
+            // not needed by any output
+            element = Element::none;
+            return;
+        }
+        if (element == Element::created_at && (highWater || fingerprints)
+                && alreadyWritten(parseCreatedAt(str, length))) {
+            // converted by a previous run, don't bother copying the rest
+            skip_item = true;
+            element = Element::none;
+            return;
+        }
+
+        if (element == Element::objectID) {
+            item.objectID = atoi(str);
+            filterField();
+            element = Element::none;
             return;
+        }
 
-        // minimal string normalization
-        string s = str;
-        replace(s.begin(), s.end(), '\n', ' ');
-        remove(s.begin(), s.end(), '\r');
+        // minimal string normalization, up to the first NUL
+        size_t len = strlen(str);
+        char *p = item_arena->copy(str, len);
+        replace(p, p + len, '\n', ' ');
+        remove(p, p + len, '\r');
+        Text s(p, len);
 
         switch (element) {
         case Element::created_at:     item.created_at = s;    break;
@@ -290,24 +4848,101 @@ struct ItemsHandler {
         case Element::comment_text:   item.comment_text = s;  break;
         case Element::story_title:    item.story_title = s;   break;
         case Element::story_url:      item.story_url = s;     break;
-        case Element::objectID:       item.objectID = atoi(s.c_str()); break;
         default:                      break;
         }
+        filterField();
 
         element = Element::none;
     }
-    void StartObject() { ++level; }
+    void StartObject()
+    {
+        if (++level == 2) {
+            item_arena = pipeline ? &pipeline->arena() : &arena;
+            item_mark = item_arena->mark();
+        }
+    }
     void EndObject(SizeType)
     {
         if (--level == 1) {
             parent = hits;
-            dumpItemAsEmail(item, item_ids);
+            ++stats.items_parsed;
+            if (filtered_out || (filter && !filter->matches(item))
+                    || (keywords && !keyword_found))
+                ; // left out by --where or --match-any
+            else if (parsedBySinks(), alreadyWritten())
+                ++stats.items_skipped;
+            else if (seenIds && inDateRange(item)
+                    && seenIds->testAndSet(item.objectID))
+                ; // converted already
+            else if (pipeline) {
+                pipeline->push(move(item));
+                // its texts go with the batch, any strings after the last
+                // item (outside "hits") go to our own arena
+                item_arena = &arena;
+                item_mark = arena.mark();
+            } else
+                dumpItemAsEmail(item, item_ids);
+            // the texts of the items not passed on can be reused
+            item_arena->release(item_mark);
             item = {};
+            skip_item = false;
+            filtered_out = false;
+            keyword_found = false;
+            if (filter)
+                filter->reset();
         }
     }
     void StartArray() { Default(); }
     void EndArray(SizeType) { Default(); }
 
+    // pass the item to the sinks that want to see every item
+    void parsedBySinks()
+    {
+        for (Sink *sink : sinks)
+            sink->parsed(item);
+    }
+
+    // the current field has been set: see if --where can tell already
+    // whether the item is wanted
+    void filterField()
+    {
+        if (filter && !filtered_out && (filter->fields() & fieldBit(element))
+                && filter->known(element, item) == Filter::no)
+            filtered_out = true;
+    }
+
+    // look for the --match-any keywords in the texts of the item
+    void matchKeywords(const Ch *str, SizeType length)
+    {
+        if (!keywords || keyword_found || skip_item || filtered_out)
+            return;
+        // the fields can come in any order, items without a match are
+        // dropped once complete
+        if (element == Element::title || element == Element::story_text
+                || element == Element::comment_text)
+            keyword_found = keywords->matches(str, length);
+    }
+
+    // whether all items dated date were written by a previous run, for
+    // --incremental and --rebuild
+    bool alreadyWritten(time_t date)
+    {
+        return (highWater && highWater->olderThan(date))
+            || (fingerprints && fingerprints->unchangedDate(date));
+    }
+
+    // whether the complete item was written by a previous run
+    bool alreadyWritten()
+    {
+        if (!highWater && !fingerprints)
+            return false;
+        if (skip_item)
+            return true;
+        MessageInfo info = messageInfo(item, item_ids);
+        return (highWater && highWater->written(info))
+            || (fingerprints && fingerprints->unchanged(info));
+    }
+
     Element element;
     enum {
         noparent,
@@ -317,21 +4952,42 @@ struct ItemsHandler {
     int level;
 
     Item item;
+    // the item is older than the --incremental high-water mark of its file
+    bool skip_item;
+    // the item doesn't match --where
+    bool filtered_out;
+    // a --match-any keyword is in the texts of the item
+    bool keyword_found;
     // key: objectID, value: parent_id, used to locate an item in its story
     // thread
-    unordered_map<unsigned, unsigned> item_ids;
+    IdMap item_ids;
+    // where items go when --jobs > 1
+    Pipeline *pipeline;
+    // the texts of the items when --jobs is 1
+    Arena arena;
+    // where the texts of the current item go, and where they begin
+    Arena *item_arena;
+    Arena::Mark item_mark;
 };
 
-unordered_map<unsigned, unsigned>
-readIdFile(const char *fname)
+IdMap readIdFile(const char *fname)
 {
-    unordered_map<unsigned, unsigned> file_ids;
+    IdMap file_ids;
     FILE *file = fopen(fname, "r");
     if (!file) {
         perror("could not open id file");
         exit(1);
     }
 
+    // size the map for the number of lines, to fill it only once
+    char buf[65536];
+    size_t len, lines = 0;
+    while ((len = fread(buf, 1, sizeof buf, file)))
+        for (char *p = buf; (p = (char*)memchr(p, '\n', buf + len - p)); ++p)
+            ++lines;
+    file_ids.reserve(lines);
+    rewind(file);
+
     int n;
     unsigned objectID, parent_id;
     while ((n = fscanf(file, "%u\t%u", &objectID, &parent_id)) != EOF) {
@@ -339,7 +4995,7 @@ readIdFile(const char *fname)
             fprintf(stderr, "bad format in id file %s\n", fname);
             exit(1);
         }
-        file_ids.insert(make_pair(objectID, parent_id));
+        file_ids.insert(objectID, parent_id);
     }
 
     return file_ids;
@@ -402,6 +5058,104 @@ struct ItemIdsHandler {
     Item item;
 };
 
+// The pre-scan of --rebuild: hashes every item as it is parsed, without
+// building it
+template<typename Encoding = UTF8<>>
+struct FingerprintHandler {
+    typedef typename Encoding::Ch Ch;
+
+    FingerprintHandler(const IdMap &item_ids)
+        : element(Element::none), level(0), item {}, hash(basis),
+          item_ids(item_ids) {}
+
+    void Default() {}
+    void Null()
+    {
+        if (level == 2)
+            add("", 1);
+        element = Element::none;
+    }
+    void Bool(bool b)
+    {
+        if (level == 2)
+            add(b ? "t" : "f", 1);
+    }
+    void Int(int i) { Int64(i); }
+    void Uint(unsigned i) { Int64(i); }
+    void Int64(int64_t i)
+    {
+        if (level != 2)
+            return;
+        add((const char*)&i, sizeof i);
+        switch (element) {
+        case Element::story_id:       item.story_id = i;      break;
+        case Element::parent_id:      item.parent_id = i;     break;
+        case Element::created_at_i:   item.created_at_i = i;  break;
+        default:                      break;
+        }
+        element = Element::none;
+    }
+    void Uint64(uint64_t i) { Int64(i); }
+    void Double(double d)
+    {
+        if (level == 2)
+            add((const char*)&d, sizeof d);
+    }
+
+    void String(const Ch* str, SizeType length, bool copy)
+    {
+        if (level != 2)
+            return;
+        add(str, length + 1);
+        if (element == Element::none) {
+            if (strcmp("story_id", str) == 0)
+                element = Element::story_id;
+            else if (strcmp("parent_id", str) == 0)
+                element = Element::parent_id;
+            else if (strcmp("created_at_i", str) == 0)
+                element = Element::created_at_i;
+            else if (strcmp("objectID", str) == 0)
+                element = Element::objectID;
+            return;
+        }
+        if (element == Element::objectID)
+            item.objectID = atoi(str);
+        element = Element::none;
+    }
+    void StartObject() { ++level; }
+    void EndObject(SizeType)
+    {
+        if (--level == 1) {
+            if (inDateRange(item)) {
+                // the References header depends on the id file too
+                for (auto i = item_ids.find(item.parent_id);
+                        i != item_ids.end() && i->second;
+                        i = item_ids.find(i->second))
+                    add((const char*)&i->second, sizeof i->second);
+                fingerprints->add(messageInfo(item, item_ids), hash);
+            }
+            item = {};
+            hash = basis;
+        }
+    }
+    void StartArray() { Default(); }
+    void EndArray(SizeType) { Default(); }
+
+    // FNV-1a
+    void add(const char *p, size_t len)
+    {
+        while (len--)
+            hash = (hash ^ (unsigned char)*p++) * 0x100000001b3ULL;
+    }
+
+    static const unsigned long long basis = 0xcbf29ce484222325ULL;
+    Element element;
+    int level;
+    Item item;
+    unsigned long long hash;
+    const IdMap &item_ids;
+};
+
 time_t parsedate(char *datestr, int *err)
 {
     struct tm date = {};
@@ -431,20 +5185,120 @@ out:
     return dateepoch;
 }
 
+// parse a size like 100, 64K, 300M or 2G, return 0 if invalid
+unsigned long long parseSize(const char *str)
+{
+    char *end;
+    unsigned long long n = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; ++end; break;
+    case 'm': case 'M': n <<= 20; ++end; break;
+    case 'g': case 'G': n <<= 30; ++end; break;
+    }
+    return *end || end == str ? 0 : n;
+}
+
+// Split --memory-limit among the parts that grow with the input: 3/8 for the
+// id map, 1/4 for --sort, 1/8 for --index and 1/8 for the output files, the
+// rest is for parsing and the --jobs pipeline. A part keeps its default if it
+// is smaller. Each one spills to --tmpdir, or closes files, to stay within
+// its share.
+void shareMemory()
+{
+    idmap_memory = memory_limit / 8 * 3;
+    sort_memory = min(sort_memory, memory_limit / 4);
+    index_memory = min(index_memory, memory_limit / 8 / jobs);
+    size_t files_memory = memory_limit / 8;
+    thread_buffer_memory = min(thread_buffer_memory, files_memory / 2);
+    // each open file has its buffer
+    size_t file_buffer = (flags & (FLAG_PREALLOCATE | FLAG_DIRECT_IO))
+        ? OutFile::chunk_size : BUFSIZ;
+    unsigned files = max<size_t>(files_memory / 2 / file_buffer, 4);
+    max_files = files;
+    max_open = min(max_open, files);
+    // only the FileWriters of mbox output keep a file per writer, for
+    // maildir and zstd --writers is the number of threads
+    if (max_writers && format == Format::mbox && !zstd_level
+            && split != Split::thread)
+        max_writers = min(max_writers, files);
+    if (flags & FLAG_STATS)
+        fprintf(stderr, "memory limit %zu MB: id map %zu MB, sort %zu MB, "
+                "index %zu MB per thread, %u open files\n",
+                memory_limit >> 20, idmap_memory >> 20, sort_memory >> 20,
+                index_memory >> 20, files);
+}
+
+// parse the argument of --split, return non zero if invalid
+int parseSplit(const char *arg)
+{
+    string s = arg;
+    split = Split::none;
+    for (size_t pos = 0, end; pos <= s.size(); pos = end + 1) {
+        end = s.find(',', pos);
+        if (end == string::npos)
+            end = s.size();
+        string opt = s.substr(pos, end - pos);
+        if (opt == "year")
+            split = Split::year;
+        else if (opt == "month")
+            split = Split::month;
+        else if (opt == "week")
+            split = Split::week;
+        else if (opt == "thread")
+            split = Split::thread;
+        else if (opt.compare(0, 5, "size:") == 0 && opt.size() > 5)
+            split_size = parseSize(opt.c_str() + 5);
+        else
+            return 1;
+        if (opt[0] == 's' && !split_size)
+            return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     static struct option long_options[] = {
         { "dump-ids",     0,                  NULL,  'd' },
         { "id-file",      required_argument,  NULL,  'i' },
-        { "split",        0,                  NULL,  'S' },
+        { "split",        optional_argument,  NULL,  'S' },
+        { "max-open",     required_argument,  NULL,  'O' },
         { "since",        required_argument,  NULL,  's' },
         { "until",        required_argument,  NULL,  'u' },
+        { "jobs",         required_argument,  NULL,  'j' },
+        { "stats",        0,                  NULL,  'T' },
+        { "writers",      required_argument,  NULL,  'W' },
+        { "format",       required_argument,  NULL,  'f' },
+        { "body-encoding", required_argument, NULL,  'b' },
+        { "mbox-variant", required_argument,  NULL,  'V' },
+        { "compress",     required_argument,  NULL,  'z' },
+        { "frame-messages", required_argument, NULL, 'F' },
+        { "extract",      required_argument,  NULL,  'x' },
+        { "message",      required_argument,  NULL,  'm' },
+        { "offset-index", optional_argument,  NULL,  'o' },
+        { "msf",          optional_argument,  NULL,  'M' },
+        { "preallocate",  no_argument,        NULL,  'P' },
+        { "dedup",        required_argument,  NULL,  'e' },
+        { "template",     required_argument,  NULL,  'L' },
+        { "where",        required_argument,  NULL,  'w' },
+        { "match-any",    required_argument,  NULL,  'a' },
+        { "incremental",  required_argument,  NULL,  'n' },
+        { "rebuild",      required_argument,  NULL,  'B' },
+        { "ids",          required_argument,  NULL,  'y' },
+        { "jsonl",        required_argument,  NULL,  'J' },
+        { "index",        required_argument,  NULL,  'I' },
+        { "search",       required_argument,  NULL,  'Q' },
+        { "sort",         required_argument,  NULL,  'r' },
+        { "sort-memory",  required_argument,  NULL,  'k' },
+        { "memory-limit", required_argument,  NULL,  'l' },
+        { "tmpdir",       required_argument,  NULL,  't' },
+        { "direct-io",    no_argument,        NULL,  'D' },
         { NULL,           0,                  NULL,  0 }
     };
 
     int opt;
     int err;
-    while ((opt = getopt_long(argc, argv, "di:Ss:u:",
+    while ((opt = getopt_long(argc, argv, "di:S::O:s:u:b:V:j:TW:f:z:F:x:m:o::M::PDr:k:t:I:Q:e:n:B:y:J:L:w:a:l:",
                               long_options, NULL)) != EOF) {
         switch (opt) {
         case 'd':
@@ -455,7 +5309,23 @@ int main(int argc, char* argv[])
             break;
         case 'S':
             flags |= FLAG_SPLIT_MBOX;
+            split = Split::month;
+            if (optarg && parseSplit(optarg)) {
+                fprintf(stderr, "invalid --split, use a comma separated list "
+                        "of year|month|week and size:N\n");
+                exit(1);
+            }
+            break;
+        case 'O': {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*end || n < 1 || n > 65536) {
+                fprintf(stderr, "invalid number in --max-open\n");
+                exit(1);
+            }
+            max_open = n;
             break;
+        }
         case 's': {
             since = parsedate(optarg, &err);
             if (err) {
@@ -472,17 +5342,291 @@ int main(int argc, char* argv[])
             }
             break;
         }
+        case 'j': {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*end || n < 1 || n > 256) {
+                fprintf(stderr, "invalid number in --jobs\n");
+                exit(1);
+            }
+            jobs = n;
+            break;
+        }
+        case 'T':
+            flags |= FLAG_STATS;
+            break;
+        case 'W': {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*end || n < 0 || n > 1024) {
+                fprintf(stderr, "invalid number in --writers\n");
+                exit(1);
+            }
+            max_writers = n;
+            break;
+        }
+        case 'f':
+            if (strcmp(optarg, "mbox") == 0) {
+                format = Format::mbox;
+            } else if (strcmp(optarg, "maildir") == 0) {
+                format = Format::maildir;
+            } else if (strcmp(optarg, "none") == 0) {
+                format = Format::none;
+            } else {
+                fprintf(stderr, "unknown --format `%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "none") == 0) {
+                body_encoding = BodyEncoding::none;
+            } else if (strcmp(optarg, "qp") == 0) {
+                body_encoding = BodyEncoding::qp;
+            } else if (strcmp(optarg, "base64") == 0) {
+                body_encoding = BodyEncoding::base64;
+            } else {
+                fprintf(stderr, "unknown --body-encoding `%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'V':
+            if (strcmp(optarg, "mboxo") == 0) {
+                mbox_variant = MboxVariant::mboxo;
+            } else if (strcmp(optarg, "mboxrd") == 0) {
+                mbox_variant = MboxVariant::mboxrd;
+            } else if (strcmp(optarg, "mboxcl2") == 0) {
+                mbox_variant = MboxVariant::mboxcl2;
+            } else {
+                fprintf(stderr, "unknown --mbox-variant `%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'z': {
+            char *end = optarg + 4;
+            long n = 3;
+            if (strncmp(optarg, "zstd", 4) == 0 && *end == ':')
+                n = strtol(end + 1, &end, 10);
+            if (strncmp(optarg, "zstd", 4) || *end || n < 1 || n > 22) {
+                fprintf(stderr, "invalid --compress, use zstd[:LEVEL]\n");
+                exit(1);
+            }
+            zstd_level = n;
+            break;
+        }
+        case 'F': {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*end || n < 1) {
+                fprintf(stderr, "invalid number in --frame-messages\n");
+                exit(1);
+            }
+            frame_messages = n;
+            break;
+        }
+        case 'x':
+            extractfile = optarg;
+            break;
+        case 'o':
+            flags |= FLAG_OFFSET_INDEX;
+            offsetindexfile = optarg;
+            break;
+        case 'M':
+            flags |= FLAG_MSF;
+            msffile = optarg;
+            break;
+        case 'e':
+            dedupfile = optarg;
+            break;
+        case 'L':
+            templatefile = optarg;
+            break;
+        case 'w':
+            whereexpr = optarg;
+            break;
+        case 'a':
+            keywordsfile = optarg;
+            break;
+        case 'n':
+            statefile = optarg;
+            break;
+        case 'B':
+            fingerprintfile = optarg;
+            break;
+        case 'y':
+            idsfile = optarg;
+            break;
+        case 'J':
+            jsonlfile = optarg;
+            break;
+        case 'I':
+            indexdir = optarg;
+            break;
+        case 'Q':
+            searchdir = optarg;
+            break;
+        case 'r':
+            if (strcmp(optarg, "none") == 0) {
+                sort_order = Sort::none;
+            } else if (strcmp(optarg, "thread") == 0) {
+                sort_order = Sort::thread;
+            } else if (strcmp(optarg, "date") == 0) {
+                sort_order = Sort::date;
+            } else {
+                fprintf(stderr, "unknown --sort `%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            sort_memory = parseSize(optarg);
+            if (sort_memory < (1 << 20)) {
+                fprintf(stderr, "invalid size in --sort-memory, "
+                        "it must be at least 1M\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            memory_limit = parseSize(optarg);
+            if (memory_limit < (64 << 20)) {
+                fprintf(stderr, "invalid size in --memory-limit, "
+                        "it must be at least 64M\n");
+                exit(1);
+            }
+            break;
+        case 't':
+            tmpdir = optarg;
+            break;
+        case 'P':
+            flags |= FLAG_PREALLOCATE;
+            break;
+        case 'D':
+            flags |= FLAG_DIRECT_IO;
+            break;
+        case 'm': {
+            char *end;
+            extract_message = strtoul(optarg, &end, 10);
+            if (*end || !extract_message) {
+                fprintf(stderr, "invalid id in --message\n");
+                exit(1);
+            }
+            break;
+        }
 
         default:
             fprintf(stderr, "usage:\n"
                     "\thn2mbox --dump-ids\n"
-                    "\thn2mbox [--id-file=FILE] [--split] "
-                    "[--since=YYYY-MM-DD] [--until=YYY-MM-DD]\n");
+                    "\thn2mbox [--id-file=FILE] "
+                    "[--split[=year|month|week|thread][,size:N]] [--max-open=N] "
+                    "[--since=YYYY-MM-DD] [--until=YYY-MM-DD]\n"
+                    "\t\t[--jobs=N] [--writers=N] [--format=mbox|maildir|none] "
+                    "[--stats]\n"
+                    "\t\t[--body-encoding=none|qp|base64] "
+                    "[--mbox-variant=mboxo|mboxrd|mboxcl2] [--template=FILE]\n"
+                    "\t\t[--compress=zstd[:LEVEL]] [--frame-messages=N]\n"
+                    "\t\t[--offset-index[=FILE]] [--msf[=FILE]] "
+                    "[--preallocate] [--direct-io]\n"
+                    "\t\t[--sort=none|thread|date] [--sort-memory=SIZE] "
+                    "[--memory-limit=SIZE]\n"
+                    "\t\t[--tmpdir=DIR] [--index=DIR] [--dedup=FILE]\n"
+                    "\t\t[--incremental=FILE] [--rebuild=FILE] "
+                    "[--ids=FILE] [--jsonl=FILE] [--where=EXPR]\n"
+                    "\t\t[--match-any=FILE]\n"
+                    "\thn2mbox --extract=FILE.zst [--message=ID] "
+                    "[--since=YYYY-MM-DD] [--until=YYY-MM-DD]\n"
+                    "\thn2mbox --search=DIR WORD...\n");
+            exit(1);
+        }
+    }
+
+    if (flags & FLAG_OFFSET_INDEX) {
+        if (format != Format::mbox) {
+            fprintf(stderr, "--offset-index is only for mbox output\n");
+            exit(1);
+        }
+        if (!(flags & FLAG_SPLIT_MBOX) && !offsetindexfile) {
+            fprintf(stderr, "--offset-index needs a FILE without --split\n");
+            exit(1);
+        }
+    }
+    if (split == Split::thread
+            && (zstd_level || (flags & (FLAG_OFFSET_INDEX | FLAG_MSF)))) {
+        fprintf(stderr, "--split=thread can't be used with --compress, "
+                "--offset-index or --msf\n");
+        exit(1);
+    }
+    if (flags & FLAG_MSF) {
+        if (format != Format::mbox || zstd_level) {
+            fprintf(stderr, "--msf is only for uncompressed mbox output\n");
+            exit(1);
+        }
+        if (!(flags & FLAG_SPLIT_MBOX) && !msffile) {
+            fprintf(stderr, "--msf needs a FILE without --split\n");
+            exit(1);
+        }
+    }
+
+    if (!tmpdir)
+        tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    if (memory_limit)
+        shareMemory();
+
+    if (flags & (FLAG_PREALLOCATE | FLAG_DIRECT_IO)) {
+        if (format != Format::mbox || zstd_level || split == Split::thread) {
+            fprintf(stderr, "--preallocate and --direct-io are only for "
+                    "uncompressed mbox output, not with --split=thread\n");
+            exit(1);
+        }
+        if (flags & FLAG_PREALLOCATE)
+            readManifest();
+    }
+
+    if (searchdir)
+        return searchIndex(searchdir, argv + optind, argc - optind);
+
+    for (const char *f : { idsfile, jsonlfile })
+        if (f && strcmp(f, "-") == 0 && format != Format::none
+                && !(flags & FLAG_SPLIT_MBOX)) {
+            fprintf(stderr, "only one output can go to stdout, use --split "
+                    "or --format=none\n");
             exit(1);
         }
+
+    if (templatefile)
+        readTemplate(templatefile);
+    if (whereexpr)
+        filter = new Filter(whereexpr);
+    if (keywordsfile)
+        keywords = new Keywords(keywordsfile);
+
+    if (fingerprintfile) {
+        if (!(flags & FLAG_SPLIT_MBOX) || format != Format::mbox
+                || statefile || dedupfile) {
+            // --dedup would skip the items of the rebuilt files as seen
+            fprintf(stderr, "--rebuild is only for --split mbox output, "
+                    "without --incremental or --dedup\n");
+            exit(1);
+        }
+        if (lseek(0, 0, SEEK_CUR) < 0) {
+            fprintf(stderr, "--rebuild reads the input twice, "
+                    "it can't be a pipe\n");
+            exit(1);
+        }
+    }
+
+#ifdef HAVE_ZSTD
+    if (extractfile)
+        return extractMessages(extractfile, extract_message);
+#else
+    if (extractfile || zstd_level) {
+        fprintf(stderr, "hn2mbox was built without zstd support, "
+                "rebuild it with `make ZSTD=1'\n");
+        exit(1);
     }
+#endif
 
-    Reader reader;
+    // the reader's stack holds a whole text, most fit in the first chunk
+    Arena stack_arena;
+    GenericReader<UTF8<>, UTF8<>, Arena> reader(&stack_arena,
+                                                Arena::chunk_size);
     char readBuffer[65536];
     FileReadStream is(stdin, readBuffer, sizeof(readBuffer));
 
@@ -495,7 +5639,108 @@ int main(int argc, char* argv[])
         if (idfile)
             handler.item_ids = readIdFile(idfile);
         printd(" item_ids size %zu\n", handler.item_ids.size());
+        if (format == Format::none)
+            ; // only the sinks are written
+        else if (format == Format::maildir)
+            maildirWriter = new MaildirWriter(max_writers ? max_writers : 4);
+#ifdef HAVE_ZSTD
+        else if (zstd_level)
+            zstdWriter = new ZstdWriter(max_writers ? max_writers : 4,
+                                        zstd_level, frame_messages);
+#endif
+        else if (split == Split::thread)
+            threadFiles = new ThreadFiles(max_open);
+        else if (max_writers && (flags & FLAG_SPLIT_MBOX))
+            fileWriters = new FileWriters(max_writers);
+        if (dedupfile)
+            seenIds = new SeenIds(dedupfile);
+        if (statefile)
+            highWater = new HighWater(statefile);
+        if (fingerprintfile) {
+            fingerprints = new Fingerprints(fingerprintfile);
+            FingerprintHandler<> prescan(handler.item_ids);
+            if (!reader.Parse<kParseValidateEncodingFlag>(is, prescan)) {
+                fprintf(stderr, "\nError(%u): %s\n",
+                        (unsigned)reader.GetErrorOffset(),
+                        reader.GetParseError());
+                return 1;
+            }
+            fingerprints->removeChanged();
+            rewind(stdin);
+            is = FileReadStream(stdin, readBuffer, sizeof(readBuffer));
+        }
+        if (sort_order != Sort::none)
+            messageSorter = new MessageSorter(sort_memory);
+        if (idsfile)
+            sinks.push_back(new IdsSink(idsfile));
+        if (jsonlfile)
+            sinks.push_back(new JsonlSink(jsonlfile));
+        if (indexdir) {
+            makeDir(indexdir);
+            sinks.push_back(new IndexBuilder(indexdir));
+        }
+        fields_needed = format == Format::none ? key_fields : all_fields;
+        for (Sink *sink : sinks)
+            fields_needed |= sink->fields();
+        if (filter)
+            fields_needed |= filter->fields();
+        Pipeline *pipeline = NULL;
+        if (jobs > 1)
+            handler.pipeline = pipeline = new Pipeline(jobs, handler.item_ids);
         ok = reader.Parse<kParseValidateEncodingFlag>(is, handler);
+        if (idfile && (flags & FLAG_STATS))
+            handler.item_ids.printStats();
+        if (pipeline) {
+            // write what was parsed, even if the input is truncated
+            pipeline->finish();
+            if (flags & FLAG_STATS)
+                pipeline->printStats();
+            delete pipeline;
+        }
+        if (seenIds) {
+            if (flags & FLAG_STATS)
+                seenIds->printStats();
+            delete seenIds;
+        }
+        for (Sink *sink : sinks) {
+            sink->finish();
+            if (flags & FLAG_STATS)
+                sink->printStats();
+            delete sink;
+        }
+        sinks.clear();
+        if (messageSorter) {
+            messageSorter->finish();
+            if (flags & FLAG_STATS)
+                messageSorter->printStats();
+            delete messageSorter;
+        }
+        if (maildirWriter) {
+            maildirWriter->finish();
+            if (flags & FLAG_STATS)
+                maildirWriter->printStats();
+            delete maildirWriter;
+        }
+#ifdef HAVE_ZSTD
+        if (zstdWriter) {
+            zstdWriter->finish();
+            if (flags & FLAG_STATS)
+                zstdWriter->printStats();
+            delete zstdWriter;
+        }
+#endif
+        if (threadFiles) {
+            threadFiles->closeAll();
+            if (flags & FLAG_STATS)
+                threadFiles->printStats();
+            delete threadFiles;
+        }
+        if (fileWriters) {
+            fileWriters->closeAll();
+            if (flags & FLAG_STATS)
+                fileWriters->printStats();
+            delete fileWriters;
+        }
     }
 
     if (!ok) {
@@ -504,8 +5749,30 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    for (auto &f : outputFiles)
-        fclose(f.second);
+    for (auto &f : outputFiles) {
+        f.second->close();
+        delete f.second;
+    }
+    fflush(stdout);
+    if (flags & FLAG_PREALLOCATE)
+        writeManifest();
+    closeSidecars();
+    if (highWater) {
+        highWater->save();
+        delete highWater;
+    }
+    if (fingerprints) {
+        fingerprints->save();
+        if (flags & FLAG_STATS)
+            fingerprints->printStats();
+        delete fingerprints;
+    }
+
+    if (flags & FLAG_STATS)
+        fprintf(stderr, "items parsed %lu, skipped %lu, written %lu, "
+                "%llu bytes\n", stats.items_parsed.load(),
+                stats.items_skipped.load(), stats.items_written.load(),
+                stats.bytes_written.load());
 
     return 0;
 }